@@ -0,0 +1,43 @@
+/*
+ * Measures heap_validate() on heaps of 10k to 1M one-byte blocks.
+ * Built once per HEAP_CHECKSUM variant by `make checksum_bench`, compare the ns/block column between runs.
+ * Slabs are built out, otherwise the blocks would be slab slots without headers of their own.
+ */
+#include <time.h>
+#include "../heap.h"
+
+#define BENCH_BUDGET 20000000   /* Headers validated per heap size */
+
+static const char *checksum_names[] = {"bytes", "words", "crc32c"};
+
+
+static double now_ns(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+
+int main(void) {
+    static const size_t counts[] = {10000, 100000, 1000000};
+
+    heap_set_check_mode(heap_check_off, 1);
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        if (heap_setup()) return printf("heap_setup failed\n"), 1;
+
+        size_t blocks = 0;
+        while (blocks < counts[c] && heap_malloc(1)) blocks++;
+        if (blocks < counts[c]) printf("heap full after %zu blocks\n", blocks);
+
+        size_t rounds = BENCH_BUDGET / blocks + 1;
+        int result = 0;
+        double start = now_ns();
+        for (size_t i = 0; i < rounds; i++) result |= heap_validate();
+        double elapsed = now_ns() - start;
+
+        printf("checksum=%-6s blocks=%-8zu validate=%10.1f us  %6.2f ns/block%s\n", checksum_names[HEAP_CHECKSUM], blocks,
+               elapsed / rounds / 1e3, elapsed / rounds / blocks, result ? "  (heap corrupted!)" : "");
+        heap_clean();
+    }
+    return 0;
+}
@@ -0,0 +1,270 @@
+/*
+ * Replays a trace written by heap_trace_start() against the default heap and the C library's allocator.
+ * Built by `make replay trace=<file>`. Reports throughput of a timed pass, then replays again sampling
+ * reserved memory after every call and fragmentation at TIMELINE_POINTS evenly spaced calls. The means of
+ * fragmentation and of the share of free memory in used and free memory sum the timeline up.
+ * Records of all threads are replayed by one thread, in the order they were written.
+ */
+#include <time.h>
+#include "../heap.h"
+
+#define NO_OBJECT UINT32_MAX
+#define TIMELINE_POINTS 20
+
+/* Trace record with blocks replaced by object numbers, failed allocations and unknown frees are dropped */
+typedef struct event_t {
+    uint64_t size;
+    uint32_t object;                /* Block passed to realloc and free */
+    uint32_t result;                /* Object created by malloc, calloc and realloc */
+    uint16_t op;
+    uint16_t alignment_shift;
+} event_t;
+
+typedef struct allocator_t {
+    const char *name;
+    int (*setup)(void);
+    void (*clean)(void);
+    void* (*malloc)(size_t size);
+    void* (*calloc)(size_t number, size_t size);
+    void* (*realloc)(void *block, size_t size);
+    void (*free)(void *block);
+    void* (*malloc_aligned)(size_t size, size_t alignment);
+    void* (*realloc_aligned)(void *block, size_t size, size_t alignment);
+    int (*stats)(heap_stats_t *stats);  /* NULL when the allocator keeps its memory to itself */
+} allocator_t;
+
+struct address_slot_t {
+    uint64_t address;
+    uint32_t object;
+};
+
+
+static int heap_replay_setup(void) {
+    heap_set_check_mode(heap_check_off, 1);
+    return heap_setup();
+}
+
+
+static int libc_setup(void) {
+    return 0;
+}
+
+
+static void libc_clean(void) {
+}
+
+
+static void* libc_malloc_aligned(size_t size, size_t alignment) {
+    return aligned_alloc(alignment, (size + alignment - 1) & ~(alignment - 1));
+}
+
+
+static void* libc_realloc_aligned(void *block, size_t size, size_t alignment) {
+    void *moved = realloc(block, size);
+    if (!moved || (uintptr_t)moved % alignment == 0) return moved;
+    void *aligned = libc_malloc_aligned(size, alignment);
+    if (aligned) memcpy(aligned, moved, size);
+    free(moved);
+    return aligned;
+}
+
+
+static const allocator_t allocators[] = {
+    {"heap", heap_replay_setup, heap_clean, heap_malloc, heap_calloc, heap_realloc, heap_free,
+     heap_malloc_aligned_to, heap_realloc_aligned_to, heap_get_stats},
+    {"libc", libc_setup, libc_clean, malloc, calloc, realloc, free, libc_malloc_aligned, libc_realloc_aligned, NULL},
+};
+
+
+static double now_ns(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+
+/* Open addressing with linear probing, removal shifts the following entries back instead of leaving tombstones */
+static struct address_slot_t *addresses;
+static size_t address_mask;
+
+
+static size_t address_slot(uint64_t address) {
+    size_t slot = (size_t)((address >> 4) * 0x9E3779B97F4A7C15ull) & address_mask;
+    while (addresses[slot].address && addresses[slot].address != address) slot = (slot + 1) & address_mask;
+    return slot;
+}
+
+
+static uint32_t address_take(uint64_t address) {
+    if (!address) return NO_OBJECT;
+    size_t slot = address_slot(address);
+    if (!addresses[slot].address) return NO_OBJECT;
+    uint32_t object = addresses[slot].object;
+
+    addresses[slot].address = 0;
+    for (size_t next = (slot + 1) & address_mask; addresses[next].address; next = (next + 1) & address_mask) {
+        size_t home = (size_t)((addresses[next].address >> 4) * 0x9E3779B97F4A7C15ull) & address_mask;
+        if (((next - home) & address_mask) >= ((next - slot) & address_mask)) {
+            addresses[slot] = addresses[next];
+            addresses[next].address = 0;
+            slot = next;
+        }
+    }
+    return object;
+}
+
+
+static void address_put(uint64_t address, uint32_t object) {
+    size_t slot = address_slot(address);
+    addresses[slot].address = address;
+    addresses[slot].object = object;
+}
+
+
+static size_t load_events(const heap_trace_record_t *records, size_t count, event_t *events, uint32_t *objects) {
+    size_t capacity = 1;
+    while (capacity < 2 * count + 2) capacity <<= 1;
+    addresses = calloc(capacity, sizeof(struct address_slot_t));
+    address_mask = capacity - 1;
+    if (!addresses) return 0;
+
+    size_t loaded = 0;
+    *objects = 0;
+    for (size_t i = 0; i < count; i++) {
+        const heap_trace_record_t *record = records + i;
+        event_t event = {record->size, NO_OBJECT, NO_OBJECT, record->op, record->alignment_shift};
+
+        if (record->op == heap_trace_free) {
+            event.object = address_take(record->block);
+            if (event.object == NO_OBJECT) continue;
+        } else if (record->op == heap_trace_realloc) {
+            if (!record->result && record->size) continue;     //Failed, the block stays where it was
+            event.object = address_take(record->block);
+            if (event.object == NO_OBJECT && !record->result) continue;
+        } else if (!record->result) {
+            continue;
+        }
+        if (record->result) {
+            event.result = (*objects)++;
+            address_put(record->result, event.result);
+        }
+        events[loaded++] = event;
+    }
+    free(addresses);
+    return loaded;
+}
+
+
+/* Returns the number of allocations that failed */
+static size_t replay(const allocator_t *allocator, const event_t *events, size_t count, void **objects,
+                     size_t step, uint64_t *peak_sbrk, uint64_t *peak_total, double *fragmentation, double *free_share) {
+    size_t failed = 0, points = 0;
+    for (size_t i = 0; i < count; i++) {
+        const event_t *event = events + i;
+        void *block = event->object == NO_OBJECT ? NULL : objects[event->object];
+        size_t alignment = event->alignment_shift ? (size_t)1 << event->alignment_shift : 0;
+        void *result = NULL;
+
+        switch (event->op) {
+            case heap_trace_malloc:
+                result = alignment ? allocator->malloc_aligned(event->size, alignment) : allocator->malloc(event->size);
+                break;
+            case heap_trace_calloc:
+                result = allocator->calloc(1, event->size);
+                break;
+            case heap_trace_realloc:
+                result = alignment ? allocator->realloc_aligned(block, event->size, alignment) : allocator->realloc(block, event->size);
+                break;
+            default:
+                allocator->free(block);
+                break;
+        }
+        if (event->result != NO_OBJECT) {
+            objects[event->result] = result;
+            failed += !result;
+        }
+
+        if (!step) continue;
+        uint64_t sbrk = custom_sbrk_get_reserved_memory(), total = sbrk + custom_mmap_get_reserved_memory();
+        *peak_sbrk = sbrk > *peak_sbrk ? sbrk : *peak_sbrk;
+        *peak_total = total > *peak_total ? total : *peak_total;
+
+        heap_stats_t stats;
+        if ((i + 1) % step == 0 && allocator->stats && allocator->stats(&stats) == 0) {
+            printf("  %12zu %14zu %14zu %12zu %10.3f\n", i + 1, stats.reserved_bytes, stats.used_bytes,
+                   stats.free_bytes, stats.fragmentation);
+            *fragmentation += stats.fragmentation;
+            *free_share += (double)stats.free_bytes / (double)(stats.used_bytes + stats.free_bytes + 1);
+            points++;
+        }
+    }
+    if (points) {
+        *fragmentation /= points;
+        *free_share /= points;
+    }
+    return failed;
+}
+
+
+static void release_all(const allocator_t *allocator, const event_t *events, size_t count, void **objects, uint32_t object_count) {
+    //Objects released or moved by the trace are cleared first, the rest is still allocated
+    for (size_t i = 0; i < count; i++) {
+        if (events[i].object != NO_OBJECT) objects[events[i].object] = NULL;
+    }
+    for (uint32_t i = 0; i < object_count; i++) allocator->free(objects[i]);
+    allocator->clean();
+}
+
+
+int main(int argc, char **argv) {
+    if (argc < 2) return printf("usage: %s <trace>\n", argv[0]), 1;
+
+    FILE *file = fopen(argv[1], "rb");
+    if (!file) return printf("can't open %s\n", argv[1]), 1;
+    char magic[8];
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    size_t count = length > 8 ? (size_t)(length - 8) / sizeof(heap_trace_record_t) : 0;
+    heap_trace_record_t *records = malloc(count * sizeof(heap_trace_record_t) + 1);
+    event_t *events = malloc(count * sizeof(event_t) + 1);
+    if (!records || !events || fread(magic, 1, 8, file) != 8 || memcmp(magic, HEAP_TRACE_MAGIC, 8)
+        || fread(records, sizeof(heap_trace_record_t), count, file) != count) {
+        return printf("%s is not a heap trace\n", argv[1]), 1;
+    }
+    fclose(file);
+
+    uint32_t object_count = 0;
+    size_t loaded = load_events(records, count, events, &object_count);
+    void **objects = calloc(object_count + 1, sizeof(void*));
+    if (!objects || (count && !loaded)) return printf("out of memory\n"), 1;
+    printf("%s: %zu records, %zu replayed, %u blocks, %.3f s traced\n", argv[1], count, loaded, object_count,
+           count ? (double)records[count - 1].time / 1e9 : 0.0);
+    free(records);
+
+    for (size_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); a++) {
+        const allocator_t *allocator = allocators + a;
+        uint64_t peak_sbrk = 0, peak_total = 0;
+        double fragmentation = 0.0, free_share = 0.0;
+
+        if (allocator->setup()) return printf("%s: setup failed\n", allocator->name), 1;
+        double start = now_ns();
+        size_t failed = replay(allocator, events, loaded, objects, 0, NULL, NULL, NULL, NULL);
+        double elapsed = now_ns() - start;
+        release_all(allocator, events, loaded, objects, object_count);
+
+        printf("\n%s: %10.1f ns/call %12.0f calls/s%s\n", allocator->name, loaded ? elapsed / loaded : 0.0,
+               elapsed > 0 ? loaded / elapsed * 1e9 : 0.0, failed ? "  (allocations failed!)" : "");
+        if (!allocator->stats) continue;
+
+        printf("  %12s %14s %14s %12s %10s\n", "calls", "reserved", "used", "free", "frag");
+        allocator->setup();
+        replay(allocator, events, loaded, objects, loaded / TIMELINE_POINTS + 1, &peak_sbrk, &peak_total, &fragmentation, &free_share);
+        release_all(allocator, events, loaded, objects, object_count);
+        printf("  peak sbrk reserved %" PRIu64 " bytes, with mappings %" PRIu64 " bytes\n", peak_sbrk, peak_total);
+        printf("  mean fragmentation %.3f, mean free share %.3f\n", fragmentation, free_share);
+    }
+    free(objects);
+    free(events);
+    return 0;
+}
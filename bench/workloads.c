@@ -0,0 +1,384 @@
+/*
+ * Allocation workloads timed on the default heap and on the C library's allocator.
+ * Built by `make workloads_bench`. Every workload is generated up front from a fixed seed into a list of calls on numbered
+ * slots, so both allocators run exactly the same calls. One pass samples reserved memory after every call for its peak,
+ * resident memory for the C library, then a timed pass stamps every call for ns/op and p50/p99 latency.
+ * Results are printed and written to the file given as the first argument, as JSON when its name ends with .json
+ * and as CSV otherwise.
+ */
+#define _POSIX_C_SOURCE 200809L     /* For pread() */
+#include <time.h>
+#include "../heap.h"
+
+#if defined(__linux__)
+#include <fcntl.h>                  /* For open() of /proc/self/statm */
+#endif
+#if defined(__GLIBC__)
+#include <malloc.h>                 /* For malloc_trim() */
+#endif
+
+#define SLOTS 4096
+#define CHURN_CALLS 400000
+#define PHASE_BLOCKS 50000
+#define PHASE_ROUNDS 4
+#define GROWTH_SLOTS 256
+#define GROWTH_LIMIT 0x10000
+
+typedef enum call_op_t {
+    call_malloc,
+    call_malloc_aligned,
+    call_realloc,
+    call_free
+} call_op_t;
+
+typedef struct call_t {
+    uint32_t slot;
+    uint32_t size;
+    uint16_t op;
+    uint16_t alignment_shift;
+} call_t;
+
+typedef struct workload_t {
+    const char *name;
+    size_t (*generate)(call_t *calls);  /* Returns the number of calls, at most max_calls */
+    size_t max_calls;
+} workload_t;
+
+typedef struct allocator_t {
+    const char *name;
+    int (*setup)(void);
+    void (*clean)(void);
+    void* (*malloc)(size_t size);
+    void* (*realloc)(void *block, size_t size);
+    void (*free)(void *block);
+    void* (*malloc_aligned)(size_t size, size_t alignment);
+    uint64_t (*reserved)(void);         /* NULL when the allocator doesn't tell */
+} allocator_t;
+
+typedef struct result_t {
+    size_t calls;
+    double ns_per_call;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t peak_reserved;
+    size_t failed;
+} result_t;
+
+
+static uint64_t random_state = 0x9E3779B97F4A7C15ull;
+
+
+static uint64_t next_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+
+static uint32_t random_below(uint32_t limit) {
+    return (uint32_t)(next_random() % limit);
+}
+
+
+static void put(call_t *call, call_op_t op, uint32_t slot, uint32_t size, uint16_t alignment_shift) {
+    call->slot = slot;
+    call->size = size;
+    call->op = op;
+    call->alignment_shift = alignment_shift;
+}
+
+
+/* Fills every slot, then keeps replacing random ones */
+static size_t churn(call_t *calls, uint32_t (*size)(void)) {
+    size_t count = 0;
+    for (uint32_t slot = 0; slot < SLOTS; slot++) put(calls + count++, call_malloc, slot, size(), 0);
+    while (count < CHURN_CALLS) {
+        uint32_t slot = random_below(SLOTS);
+        put(calls + count++, call_free, slot, 0, 0);
+        put(calls + count++, call_malloc, slot, size(), 0);
+    }
+    return count;
+}
+
+
+static uint32_t fixed_size(void) {
+    return 64;
+}
+
+
+static uint32_t uniform_size(void) {
+    return 1 + random_below(4096);
+}
+
+
+/* Each power of two from 16 bytes to 256 KiB half as likely as the one before */
+static uint32_t power_law_size(void) {
+    uint32_t shift = 0;
+    while (shift < 14 && next_random() & 1) shift++;
+    return (16u << shift) + random_below(16u << shift);
+}
+
+
+static size_t fixed_churn(call_t *calls) {
+    return churn(calls, fixed_size);
+}
+
+
+static size_t random_churn(call_t *calls) {
+    return churn(calls, uniform_size);
+}
+
+
+static size_t power_law_churn(call_t *calls) {
+    return churn(calls, power_law_size);
+}
+
+
+/* Blocks grow by half at a time, one reaching GROWTH_LIMIT starts over from 16 bytes */
+static size_t realloc_growth(call_t *calls) {
+    static uint32_t sizes[GROWTH_SLOTS];
+    size_t count = 0;
+    for (uint32_t slot = 0; slot < GROWTH_SLOTS; slot++) {
+        sizes[slot] = 16;
+        put(calls + count++, call_malloc, slot, sizes[slot], 0);
+    }
+    while (count < CHURN_CALLS) {
+        uint32_t slot = random_below(GROWTH_SLOTS);
+        sizes[slot] += sizes[slot] / 2;
+        if (sizes[slot] <= GROWTH_LIMIT) {
+            put(calls + count++, call_realloc, slot, sizes[slot], 0);
+            continue;
+        }
+        sizes[slot] = 16;
+        put(calls + count++, call_free, slot, 0, 0);
+        put(calls + count++, call_malloc, slot, sizes[slot], 0);
+    }
+    return count;
+}
+
+
+/* Rounds of PHASE_BLOCKS allocations followed by freeing all of them in random order */
+static size_t phases(call_t *calls) {
+    static uint32_t order[PHASE_BLOCKS];
+    size_t count = 0;
+    for (int round = 0; round < PHASE_ROUNDS; round++) {
+        for (uint32_t slot = 0; slot < PHASE_BLOCKS; slot++) {
+            put(calls + count++, call_malloc, slot, 16 + random_below(496), 0);
+            order[slot] = slot;
+        }
+        for (uint32_t i = PHASE_BLOCKS - 1; i > 0; i--) {
+            uint32_t j = random_below(i + 1), swapped = order[i];
+            order[i] = order[j];
+            order[j] = swapped;
+        }
+        for (uint32_t i = 0; i < PHASE_BLOCKS; i++) put(calls + count++, call_free, order[i], 0, 0);
+    }
+    return count;
+}
+
+
+/* Alignments from 32 bytes to a page */
+static size_t aligned_churn(call_t *calls) {
+    size_t count = 0;
+    for (uint32_t slot = 0; slot < SLOTS / 2; slot++) {
+        put(calls + count++, call_malloc_aligned, slot, 1 + random_below(2048), 5 + random_below(8));
+    }
+    while (count < CHURN_CALLS) {
+        uint32_t slot = random_below(SLOTS / 2);
+        put(calls + count++, call_free, slot, 0, 0);
+        put(calls + count++, call_malloc_aligned, slot, 1 + random_below(2048), 5 + random_below(8));
+    }
+    return count;
+}
+
+
+static const workload_t workloads[] = {
+    {"fixed_churn", fixed_churn, CHURN_CALLS + 1},
+    {"random_churn", random_churn, CHURN_CALLS + 1},
+    {"power_law", power_law_churn, CHURN_CALLS + 1},
+    {"realloc_growth", realloc_growth, CHURN_CALLS + 1},
+    {"phases", phases, 2 * PHASE_BLOCKS * PHASE_ROUNDS},
+    {"aligned", aligned_churn, CHURN_CALLS + 1},
+};
+
+
+static int heap_bench_setup(void) {
+    heap_set_check_mode(heap_check_off, 1);
+    return heap_setup();
+}
+
+
+static uint64_t heap_reserved(void) {
+    return custom_sbrk_get_reserved_memory() + custom_mmap_get_reserved_memory();
+}
+
+
+static int libc_setup(void) {
+    return 0;
+}
+
+
+static void libc_clean(void) {
+#if defined(__GLIBC__)
+    malloc_trim(0);             //Returns free memory kept by the C library, the next workload starts from the same base
+#endif
+}
+
+
+static void* libc_malloc_aligned(size_t size, size_t alignment) {
+    return aligned_alloc(alignment, (size + alignment - 1) & ~(alignment - 1));
+}
+
+
+#if defined(__linux__)
+/* The C library doesn't report what it holds, the process' resident memory is used instead */
+static uint64_t libc_reserved(void) {
+    static int statm = -1;
+    char text[64] = {0};
+    unsigned long long size, resident;
+    if (statm < 0) statm = open("/proc/self/statm", O_RDONLY);
+    if (pread(statm, text, sizeof(text) - 1, 0) <= 0 || sscanf(text, "%llu %llu", &size, &resident) != 2) return 0;
+    return resident * (uint64_t)sysconf(_SC_PAGESIZE);
+}
+#else
+#define libc_reserved NULL
+#endif
+
+
+static const allocator_t allocators[] = {
+    {"heap", heap_bench_setup, heap_clean, heap_malloc, heap_realloc, heap_free, heap_malloc_aligned_to, heap_reserved},
+    {"libc", libc_setup, libc_clean, malloc, realloc, free, libc_malloc_aligned, libc_reserved},
+};
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+
+static void* perform(const allocator_t *allocator, void **slots, const call_t *call) {
+    void *block = NULL;
+    switch (call->op) {
+        case call_malloc:
+            block = allocator->malloc(call->size);
+            break;
+        case call_malloc_aligned:
+            block = allocator->malloc_aligned(call->size, (size_t)1 << call->alignment_shift);
+            break;
+        case call_realloc:
+            block = allocator->realloc(slots[call->slot], call->size);
+            if (!block) return NULL;    //The old block stays in its slot
+            break;
+        default:
+            allocator->free(slots[call->slot]);
+            break;
+    }
+    slots[call->slot] = block;
+    if (block) *(volatile uint8_t*)block = 1;
+    return block;
+}
+
+
+static void release_slots(const allocator_t *allocator, void **slots, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        allocator->free(slots[i]);
+        slots[i] = NULL;
+    }
+    allocator->clean();
+}
+
+
+static int compare_latency(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+
+static int run(const allocator_t *allocator, const call_t *calls, size_t count, void **slots, uint64_t *latencies, result_t *result) {
+    memset(result, 0x0, sizeof(result_t));
+    result->calls = count;
+
+    //Goes first, memory the C library keeps after a pass would hide the next pass' peak
+    if (allocator->reserved) {
+        uint64_t base = allocator->reserved(), peak = base;
+        if (allocator->setup()) return 1;
+        for (size_t i = 0; i < count; i++) {
+            perform(allocator, slots, calls + i);
+            uint64_t reserved = allocator->reserved();
+            peak = reserved > peak ? reserved : peak;
+        }
+        result->peak_reserved = peak - base;
+        release_slots(allocator, slots, PHASE_BLOCKS);
+    }
+
+    if (allocator->setup()) return 1;
+    uint64_t start = now_ns(), previous = start;
+    for (size_t i = 0; i < count; i++) {
+        result->failed += !perform(allocator, slots, calls + i) && calls[i].op != call_free;
+        uint64_t stamp = now_ns();
+        latencies[i] = stamp - previous;
+        previous = stamp;
+    }
+    result->ns_per_call = count ? (double)(previous - start) / count : 0.0;
+    release_slots(allocator, slots, PHASE_BLOCKS);
+
+    qsort(latencies, count, sizeof(uint64_t), compare_latency);
+    result->p50 = count ? latencies[count / 2] : 0;
+    result->p99 = count ? latencies[count * 99 / 100] : 0;
+    return 0;
+}
+
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : "bench.csv";
+    size_t length = strlen(path);
+    bool json = length >= 5 && strcmp(path + length - 5, ".json") == 0;
+    FILE *file = fopen(path, "w");
+    if (!file) return printf("can't create %s\n", path), 1;
+
+    size_t max_calls = 0;
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        max_calls = workloads[w].max_calls > max_calls ? workloads[w].max_calls : max_calls;
+    }
+    call_t *calls = malloc(max_calls * sizeof(call_t));
+    uint64_t *latencies = malloc(max_calls * sizeof(uint64_t));
+    void **slots = calloc(PHASE_BLOCKS, sizeof(void*));
+    if (!calls || !latencies || !slots) return printf("out of memory\n"), 1;
+
+    fprintf(file, json ? "[\n" : "allocator,workload,calls,ns_per_call,p50_ns,p99_ns,peak_reserved_bytes,failed\n");
+    bool first = true;
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        random_state = 0x9E3779B97F4A7C15ull;
+        size_t count = workloads[w].generate(calls);
+
+        for (size_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); a++) {
+            result_t result;
+            if (run(allocators + a, calls, count, slots, latencies, &result)) return printf("%s: setup failed\n", allocators[a].name), 1;
+
+            printf("%-5s %-15s %8zu calls %8.1f ns/call  p50 %6" PRIu64 " ns  p99 %7" PRIu64 " ns  peak %11" PRIu64 " B%s\n",
+                   allocators[a].name, workloads[w].name, result.calls, result.ns_per_call, result.p50, result.p99,
+                   result.peak_reserved, result.failed ? "  (allocations failed!)" : "");
+            if (json) {
+                fprintf(file, "%s  {\"allocator\": \"%s\", \"workload\": \"%s\", \"calls\": %zu, \"ns_per_call\": %.2f, "
+                        "\"p50_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64 ", \"peak_reserved_bytes\": %" PRIu64 ", \"failed\": %zu}",
+                        first ? "" : ",\n", allocators[a].name, workloads[w].name, result.calls, result.ns_per_call,
+                        result.p50, result.p99, result.peak_reserved, result.failed);
+            } else {
+                fprintf(file, "%s,%s,%zu,%.2f,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%zu\n", allocators[a].name, workloads[w].name,
+                        result.calls, result.ns_per_call, result.p50, result.p99, result.peak_reserved, result.failed);
+            }
+            first = false;
+        }
+    }
+    if (json) fprintf(file, "\n]\n");
+    fclose(file);
+    printf("results written to %s\n", path);
+
+    free(slots);
+    free(latencies);
+    free(calls);
+    return 0;
+}
@@ -10,6 +10,7 @@
 #include <unistd.h>
 #include <stdint.h>
 
+// Strony dołączane do sterty i z niej zwracane są wyzerowane.
 void* custom_sbrk(intptr_t delta);
 
 #if defined(sbrk)
@@ -26,6 +27,7 @@ void* custom_sbrk(intptr_t delta);
 
 //
 // Funkcja testuje płotki ustawione przed i po obszarze przyznanym przez sbrk().
+// W trybie szybkim (MEMORY_FAST_SBRK) custom_sbrk() robi to tylko co kilkaset wywołań, pozostałe sprawdzenia są na żądanie.
 // Funkcja zwraca:
 //    0 - płotki są nienaruszone
 //  !=0 - kod diagnostyczny (płotki zostały popsute)
@@ -36,5 +38,22 @@ int custom_sbrk_check_fences_integrity(void);
 // do systemu operacyjnego.
 uint64_t custom_sbrk_get_reserved_memory(void);
 
+//
+// Emulacja anonimowego mmap()/munmap(). Mapowania są przydzielane stronami z górnej części przestrzeni sterty,
+// poniżej płotka końca, i nigdy nie nachodzą na obszar sterty ani jej płotek brk.
+// Nowo przydzielone strony są wyzerowane.
+// Funkcja custom_mmap zwraca (void*)-1 w przypadku braku miejsca.
+void* custom_mmap(size_t length);
+int custom_munmap(void* addr, size_t length);
+
+//
+// Emulacja mremap(): zmienia długość mapowania. Powiększane mapowanie rośnie w miejscu, gdy strony za nim są wolne,
+// w przeciwnym razie (may_move != 0) jest przenoszone w całości pod nowy adres. Zwraca (void*)-1 w przypadku braku miejsca.
+void* custom_mremap(void* old_address, size_t old_length, size_t new_length, int may_move);
+
+//
+// Funkcja zwraca ilość (w bajtach) pamięci przydzielonej przez `custom_mmap`.
+uint64_t custom_mmap_get_reserved_memory(void);
+
 #endif // _CUSTOM_UNISTD_H_
 
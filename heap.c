@@ -3,7 +3,26 @@
 
 
 
-static Heap__ *heap = NULL;
+static Heap__ *_Atomic main_heap = NULL;
+static PageEntry__ main_page_map[HEAP_MAX_PAGES];
+static pthread_mutex_t heap_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_size_t heap_generation = 0;   /* Changes with every setup and clean, invalidates thread caches, odd while there is a heap */
+static heap_check_mode_t check_mode = HEAP_CHECK_MODE;
+static size_t check_parameter = HEAP_CHECK_PARAMETER;
+static size_t mmap_threshold = HEAP_MMAP_THRESHOLD;
+static size_t trim_threshold = HEAP_TRIM_THRESHOLD;
+static size_t trim_pad = HEAP_TRIM_PAD;
+static size_t growth_min = HEAP_GROWTH_MIN;
+static size_t growth_max = HEAP_GROWTH_MAX;
+static unsigned growth_percent = HEAP_GROWTH_PERCENT;
+
+static void free_unlocked(Heap__ *heap, void* memblock);
+static void* malloc_unlocked(Heap__ *heap, size_t size);
+static void* malloc_aligned_unlocked(Heap__ *heap, size_t count, size_t alignment);
+static enum pointer_type_t pointer_type_unlocked(Heap__ *heap, const void* pointer);
+static enum pointer_type_t classify_pointer(Heap__ *heap, const void* pointer);
+static void large_free(Heap__ *heap, Header__ *header);
+static void drain_remote_frees(Heap__ *heap);
 
 static long long calc_ptrs_distance(void *previous, void *further) {
     if (!previous || !further) return 0;
@@ -11,40 +30,76 @@ static long long calc_ptrs_distance(void *previous, void *further) {
 }
 
 
-int heap_setup(void) {
-    if ((heap = (Heap__*)custom_sbrk(MY_PAGE_SIZE)) == SBRK_FAIL) return HEAP_INIT_FAIL;
-    heap->pages = 1;
+static uint64_t clock_ns(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+
+static void init_heap(Heap__ *heap, size_t max_pages, PageEntry__ *page_map, size_t page_map_length, size_t control_size) {
+    heap->pages = (ALIGN_UP(control_size) + MY_PAGE_SIZE - 1) / MY_PAGE_SIZE;
+    heap->max_pages = max_pages;
+    heap->control_size = ALIGN_UP(control_size);
+    heap->page_map = page_map;
+    heap->page_map_length = page_map_length;
+    memset(page_map, 0x0, page_map_length * sizeof(PageEntry__));   //The default heap's map may still describe an earlier heap
     heap->control_sum = 0;
     heap->headers_allocated = 0;
     heap->head = NULL;
-    return 0;
+    heap->large = NULL;
+    heap->large_blocks = 0;
+    heap->large_bytes = 0;
+    heap->large_mapped = 0;
+    heap->clean = (uint8_t*)heap + heap->control_size;
+    heap->tail_end = heap->clean;
+    memset(heap->bins, 0x0, sizeof(heap->bins));
+    heap->free_tree = NULL;
+    heap->bins_map = 0;
+    memset(heap->bin_counts, 0x0, sizeof(heap->bin_counts));
+    heap->free_blocks = 0;
+    heap->free_bytes = 0;
+    heap->growths = 0;
+    heap->grown_bytes = 0;
+    memset(heap->slabs, 0x0, sizeof(heap->slabs));
+    heap->check_calls = 0;
+    heap->check_cursor = NULL;
+    heap->compact_cursor = NULL;
+    for (size_t i = 0; i < REMOTE_FREE_SLOTS; i++) atomic_init(&heap->remote_frees[i], NULL);
+    atomic_init(&heap->remote_pending, 0);
 }
 
 
-static unsigned long compute_fences() {
-    Header__ *iterator = heap->head; //iterator is equal to left fence
-    if (!iterator) return 0;
+/* Counts fence bytes still holding the pattern, an intact fence is compared as a whole */
+static unsigned long intact_fence_bytes(const uint8_t *fence, uint8_t pattern) {
+    uint8_t expected[FENCE_LENGTH];
+    memset(expected, pattern, FENCE_LENGTH);
+    if (memcmp(fence, expected, FENCE_LENGTH) == 0) return FENCE_LENGTH;
 
     unsigned long counter = 0;
-    while (iterator) {
-        for (int i = 0; i < FENCE_LENGTH; i++) {
-            if (*((uint8_t*)iterator + i + CONTROL_STRUCT_SIZE) == 'f') counter++;
-            if (*((uint8_t*)iterator->user_mem_ptr + i + iterator->mem_size) == 'F') counter++;
-        }
-        iterator = iterator->next;
-    }
+    for (int i = 0; i < FENCE_LENGTH; i++) counter += fence[i] == pattern;
     return counter;
 }
 
 
-static Header__* last() {
+/*
+ * Starts from the last page holding a header, or covered by a used block, instead of the head.
+ * No block ends past heap->clean, pages after it are skipped, the heap grows ahead of its blocks.
+ */
+static Header__* last(Heap__ *heap) {
     if (!heap || !heap->head) return NULL;
-    Header__ *iterator = heap->head;
+    Header__ *iterator = NULL;
+    size_t pages = (size_t)(heap->clean - (uint8_t*)heap + MY_PAGE_SIZE - 1) / MY_PAGE_SIZE;
+    for (size_t page = pages < heap->pages ? pages : heap->pages; page-- > 0 && !iterator;) {
+        iterator = heap->page_map[page].first ? heap->page_map[page].first : heap->page_map[page].cover;
+    }
+    if (!iterator) iterator = heap->head;
     while (iterator->next) iterator = iterator->next;
     return iterator;
 }
 
 
+#if HEAP_CHECKSUM == HEAP_CHECKSUM_BYTES
 static long long compute_control_sum(void *pointer, size_t size) {
     long long control_sum = 0;
     uint8_t *ptr = (uint8_t *)pointer;
@@ -53,491 +108,2293 @@ static long long compute_control_sum(void *pointer, size_t size) {
     }
     return control_sum;
 }
+#elif HEAP_CHECKSUM == HEAP_CHECKSUM_WORDS
+static long long compute_control_sum(void *pointer, size_t size) {
+    uint64_t control_sum = size, word;
+    uint8_t *ptr = (uint8_t *)pointer;
+    size_t i = 0;
+    for (; i + sizeof(word) <= size; i += sizeof(word)) {
+        memcpy(&word, ptr + i, sizeof(word)); //Headers are 16-byte aligned, compiles to a plain load
+        control_sum = ((control_sum << 7) | (control_sum >> 57)) + word;
+    }
+    if (i < size) {
+        word = 0;
+        memcpy(&word, ptr + i, size - i);
+        control_sum = ((control_sum << 7) | (control_sum >> 57)) + word;
+    }
+    return (long long)control_sum;
+}
+#elif HEAP_CHECKSUM == HEAP_CHECKSUM_CRC32C
+static uint32_t crc32c_word(uint32_t crc, uint64_t word) {
+#if defined(__SSE4_2__)
+    return (uint32_t)_mm_crc32_u64(crc, word);
+#elif defined(__ARM_FEATURE_CRC32)
+    return __crc32cd(crc, word);
+#else
+    //Bitwise fallback, reflected Castagnoli polynomial
+    for (int i = 0; i < 64; i++, word >>= 1) {
+        crc = (crc >> 1) ^ (0x82F63B78u & (0u - ((crc ^ (uint32_t)word) & 1u)));
+    }
+    return crc;
+#endif
+}
+
+static long long compute_control_sum(void *pointer, size_t size) {
+    uint32_t crc = ~0u;
+    uint64_t word;
+    uint8_t *ptr = (uint8_t *)pointer;
+    size_t i = 0;
+    for (; i + sizeof(word) <= size; i += sizeof(word)) {
+        memcpy(&word, ptr + i, sizeof(word)); //Headers are 16-byte aligned, compiles to a plain load
+        crc = crc32c_word(crc, word);
+    }
+    if (i < size) {
+        word = 0;
+        memcpy(&word, ptr + i, size - i);
+        crc = crc32c_word(crc, word);
+    }
+    return (long long)~crc;
+}
+#else
+#error "Unknown HEAP_CHECKSUM"
+#endif
+
+
+/* Checksum of the fields in front of control_sum and is_free, folded to 32 bits */
+static uint32_t header_control_sum(Header__ *header) {
+    uint64_t control_sum = (uint64_t)compute_control_sum(header, offsetof(Header__, control_sum)) + header->is_free;
+    return (uint32_t)(control_sum ^ control_sum >> 32);
+}
 
 
 static void update_header_control_sum(Header__ *header) {
-    header->control_sum = 0;
-    header->control_sum = compute_control_sum(header, sizeof(Header__) - sizeof(header->control_sum));
+    header->control_sum = header_control_sum(header);
 }
 
 
-static bool is_control_sum_valid() {
-    Header__ *iterator = heap->head;
-    if (!iterator) return true;
-    while (iterator) {
-        Header__ copy = *iterator;
-        copy.control_sum = 0;
-        long long control_sum = compute_control_sum(&copy, sizeof(copy) - sizeof(copy.control_sum));
-        if (control_sum != iterator->control_sum) return false;
-        iterator = iterator->next;
-    }
-    return true;
+static bool is_header_control_sum_valid(Header__ *header) {
+    return header_control_sum(header) == header->control_sum;
 }
 
 
-int heap_validate(void) {
+static bool are_header_fences_intact(Header__ *header) {
+    return intact_fence_bytes((uint8_t*)header + CONTROL_STRUCT_SIZE, 'f') == FENCE_LENGTH
+        && intact_fence_bytes((uint8_t*)USER_MEM_PTR(header) + header->mem_size, 'F') == FENCE_LENGTH;
+}
+
+
+/* Checksums and fences are verified in one walk, fences only behind headers with a valid checksum */
+static int validate_unlocked(Heap__ *heap) {
     if (heap == NULL) return HEAP_UNINITIALIZED;
-    if (!is_control_sum_valid()) return HEAP_CONTROL_STRUCT_BLUR;
-    if (heap->control_sum != compute_fences()) return HEAP_CORRUPTED;
+
+    unsigned long fences = 0;
+    for (Header__ *iterator = heap->head; iterator; iterator = iterator->next) {
+        if (!is_header_control_sum_valid(iterator)) return HEAP_CONTROL_STRUCT_BLUR;
+        fences += intact_fence_bytes((uint8_t*)iterator + CONTROL_STRUCT_SIZE, 'f');
+        fences += intact_fence_bytes((uint8_t*)USER_MEM_PTR(iterator) + iterator->mem_size, 'F');
+    }
+    if (heap->control_sum != fences) return HEAP_CORRUPTED;
+
+    for (Header__ *iterator = heap->large; iterator; iterator = iterator->next) {
+        if (!is_header_control_sum_valid(iterator)) return HEAP_CONTROL_STRUCT_BLUR;
+        if (!are_header_fences_intact(iterator)) return HEAP_CORRUPTED;
+    }
     return 0;
 }
 
 
-void heap_clean(void) {
-    if (HEAP_UNINITIALIZED == heap_validate()) return;
-    unsigned long mem_size = heap->pages * MY_PAGE_SIZE;
-    memset(heap, 0x0, mem_size);
-    heap->head = NULL;
-    heap = NULL;
-    custom_sbrk(-mem_size);
+void heap_set_check_mode(heap_check_mode_t mode, size_t parameter) {
+    pthread_mutex_lock(&heap_mutex);
+    check_mode = mode;
+    check_parameter = parameter ? parameter : 1;
+    if (main_heap) main_heap->check_cursor = NULL;
+    pthread_mutex_unlock(&heap_mutex);
 }
 
 
-static int request_more_space(int pages_to_allocate) {
-    uint8_t *handler = custom_sbrk(MY_PAGE_SIZE * pages_to_allocate);
-    if (handler == (void*)-1) return REQUEST_SPACE_FAIL;
-    heap->pages += pages_to_allocate;
-    return 0;
+void heap_set_mmap_threshold(size_t threshold) {
+    pthread_mutex_lock(&heap_mutex);
+    mmap_threshold = threshold;
+    pthread_mutex_unlock(&heap_mutex);
 }
 
 
-static void update_heap_info() {
-    heap->headers_allocated++;
-    heap->control_sum += 2 * FENCE_LENGTH;
+void heap_set_trim_threshold(size_t threshold, size_t pad) {
+    pthread_mutex_lock(&heap_mutex);
+    trim_threshold = threshold;
+    trim_pad = pad;
+    pthread_mutex_unlock(&heap_mutex);
 }
 
 
-static void fill_fences(Header__ *header) {
-    for (int i = 0; i < FENCE_LENGTH; i++) {
-        *((uint8_t*)header + CONTROL_STRUCT_SIZE + i) = 'f';
-        *((uint8_t*)header->user_mem_ptr + header->mem_size + i) = 'F';
-    }
-    update_header_control_sum(header);
+void heap_set_growth_policy(size_t min_chunk, size_t max_chunk, unsigned percent) {
+    pthread_mutex_lock(&heap_mutex);
+    growth_min = min_chunk;
+    growth_max = max_chunk > min_chunk ? max_chunk : min_chunk;
+    growth_percent = percent;
+    pthread_mutex_unlock(&heap_mutex);
 }
 
 
-static void set_header(Header__ *header, const size_t mem_size, Header__ *prv, Header__ *nxt) {
-    header->is_free = false;
-    header->mem_size = mem_size;
-    header->prev = prv;
-    header->next = nxt;
-    header->user_mem_ptr = (uint8_t*)header + CONTROL_STRUCT_SIZE + FENCE_LENGTH;
-    if (prv){
-        prv->next = header;
-        update_header_control_sum(prv);
+/* Verifies up to check_parameter headers, resuming where the previous call stopped */
+static int validate_next_headers(Heap__ *heap) {
+    Header__ *iterator = heap->check_cursor ? heap->check_cursor : heap->head;
+    for (size_t i = 0; iterator && i < check_parameter; i++) {
+        if (!is_header_control_sum_valid(iterator)) return HEAP_CONTROL_STRUCT_BLUR;
+        if (!are_header_fences_intact(iterator)) return HEAP_CORRUPTED;
+        iterator = iterator->next;
     }
-    if (nxt){
-        nxt->prev = header, update_header_control_sum(nxt);
+    heap->check_cursor = iterator;
+    return 0;
+}
+
+
+/* Hot path counterpart of heap_validate(), as thorough as the selected check mode */
+static int heap_check(Heap__ *heap) {
+    if (heap == NULL) return HEAP_UNINITIALIZED;
+    switch (check_mode) {
+        case heap_check_off:
+            return 0;
+        case heap_check_sampled:
+            return ++heap->check_calls % check_parameter ? 0 : validate_unlocked(heap);
+        case heap_check_incremental:
+            return validate_next_headers(heap);
+        default:
+            return validate_unlocked(heap);
     }
-    fill_fences(header);
-    update_heap_info();
 }
 
 
-/*
- * From [.....cccfffUUUUUUUUUUUUUUFFF.......] to  [.....cccfffUUUFFF|cccfffUUFFF........]
- *      [       FREE HEADER BLOCK           ] to [Occupied header^  ^FREE HEADER BLOCK  ]
- *
- * c - control struct
- * f - left fence
- * U - user's memory
- * F - right fence
-*/
-static void split_headers(Header__ *header_to_reduce, size_t new_mem_size) {
-    size_t prior_mem_size = header_to_reduce->mem_size;
-    Header__ *remaining_header = (Header__*)((uint8_t*)header_to_reduce->user_mem_ptr + new_mem_size + FENCE_LENGTH);
+static size_t page_of(Heap__ *heap, const void *address) {
+    return (size_t)((intptr_t)address - (intptr_t)heap) / MY_PAGE_SIZE;
+}
 
-    header_to_reduce->is_free = false;
-    header_to_reduce->mem_size = new_mem_size;
-    fill_fences(header_to_reduce);
 
-    set_header(remaining_header, prior_mem_size - HEADER_SIZE(new_mem_size), header_to_reduce, header_to_reduce->next);
-    remaining_header->is_free = true;
-    header_to_reduce->next = remaining_header;
-    update_header_control_sum(remaining_header);
-    update_header_control_sum(header_to_reduce);
+static void page_map_add(Heap__ *heap, Header__ *header) {
+    PageEntry__ *entry = heap->page_map + page_of(heap, header);
+    if (!entry->first || entry->first > header) entry->first = header;
 }
 
-/* header - memory layout - control fences user_space fences  */
-void* heap_malloc(size_t size) {
-    if (size < 1 || heap_validate() || HEADER_SIZE(size) < size) return NULL;
 
-    //Heap has no blocks at all
-    if (!heap->head) {
-        if (heap->pages * MY_PAGE_SIZE - sizeof(Heap__) < HEADER_SIZE(size)) {
-            int pages_to_allocate = (int)((HEADER_SIZE(size) - (MY_PAGE_SIZE * heap->pages - sizeof(Heap__)))) / MY_PAGE_SIZE
-                                    + ((HEADER_SIZE(size) - (MY_PAGE_SIZE * heap->pages - sizeof(Heap__))) % MY_PAGE_SIZE != 0);
-            return REQUEST_SPACE_FAIL == request_more_space(pages_to_allocate) ? NULL : heap_malloc(size);
-        }
-        heap->head = (Header__*)((uint8_t*)heap + sizeof(Heap__));
-        set_header(heap->head, size, NULL, NULL);
-        return heap->head->user_mem_ptr;
+/* Points every page starting inside the block's extent at owner, NULL clears them when the block gets free */
+static void page_map_cover(Heap__ *heap, Header__ *header, Header__ *owner) {
+    intptr_t end = header->next ? (intptr_t)header->next : (intptr_t)USER_MEM_PTR(header) + (intptr_t)header->mem_size + FENCE_LENGTH;
+    for (size_t page = page_of(heap, header) + 1; (intptr_t)heap + (intptr_t)(page * MY_PAGE_SIZE) < end; page++) {
+        heap->page_map[page].cover = owner;
     }
+}
 
-    //Search for perfect block existing already on heap
-    Header__ *iterator = heap->head;
-    while (iterator) {
-        if (iterator->is_free && iterator->mem_size == size) {
-            iterator->is_free = false;
-            update_header_control_sum(iterator);
-            return iterator->user_mem_ptr;
-        } else if (iterator->is_free && iterator->mem_size > HEADER_SIZE(size) + 1) { //At least one byte for splittedheader's user mem
-            split_headers(iterator, size);
-            return iterator->user_mem_ptr;
-        } else if (iterator->is_free && iterator->mem_size > size) {
-            //Set new size and put new right fences, lost memory will be reverted on heap_free()
-            iterator->mem_size = size;
-            iterator->is_free = false;
-            fill_fences(iterator);
-            return iterator->user_mem_ptr;
-        }
-        iterator = iterator->next;
-    }
 
-    //Create header between last node and end of heap memory
-    Header__ *last_header = last();
+/*
+ * Constant time lookup of the header owning an address past the heap's head: the first header of the address'
+ * page when it starts earlier, its predecessor when it starts later, or the used block covering the whole page.
+ * Pages inside free blocks are not covered, only a header reaching from the previous page has to be looked for.
+ */
+static Header__* page_map_lookup(Heap__ *heap, const void *address) {
+    size_t page = page_of(heap, address);
+    Header__ *iterator = heap->page_map[page].first;
+    if (iterator && (void*)iterator > address) return iterator->prev;
+    if (!iterator) {
+        if (heap->page_map[page].cover) return heap->page_map[page].cover;
+        if (page == 0 || !(iterator = heap->page_map[page - 1].first)) return NULL;
+    }
+    while (iterator->next && (void*)iterator->next <= address) iterator = iterator->next;
+    return iterator;
+}
 
-    long long free_mem_size = calc_ptrs_distance((uint8_t*)last_header->user_mem_ptr + last_header->mem_size + FENCE_LENGTH, (uint8_t*)heap + heap->pages * MY_PAGE_SIZE);
 
-    if (free_mem_size <= (long long)(HEADER_SIZE(size))) {
-        int pages_to_allocate = (int)((HEADER_SIZE(size) - free_mem_size) / MY_PAGE_SIZE + (int)(((HEADER_SIZE(size) - free_mem_size)) % PAGE_SIZE != 0));
-        pages_to_allocate = pages_to_allocate == 0 ? 1 : pages_to_allocate;
-        return REQUEST_SPACE_FAIL == request_more_space(pages_to_allocate) ? NULL : heap_malloc(size);
-    }
+/* Drops every reference the heap keeps to a header about to be removed or moved */
+static void forget_header(Heap__ *heap, Header__ *header) {
+    if (heap->check_cursor == header) heap->check_cursor = header->prev;
+    if (heap->compact_cursor == header) heap->compact_cursor = header->prev;
 
-    set_header((Header__*)((uint8_t*)last_header->user_mem_ptr + last_header->mem_size + FENCE_LENGTH), size, last_header, NULL);
-    return last()->user_mem_ptr;
+    PageEntry__ *entry = heap->page_map + page_of(heap, header);
+    if (entry->first != header) return;
+    entry->first = header->next && page_of(heap, header->next) == page_of(heap, header) ? header->next : NULL;
+    if (!entry->first) entry->cover = header->prev && !header->prev->is_free ? header->prev : NULL;
 }
 
 
-void* heap_calloc(size_t number, size_t size) {
-    void *handler = heap_malloc(number * size);
-    if (!handler) return NULL;
-    memset(handler, 0x0, number * size);
-    return handler;
+static void clean_unlocked(Heap__ *heap) {
+    if (HEAP_UNINITIALIZED == validate_unlocked(heap)) return;
+    while (heap->large) large_free(heap, heap->large);
+    unsigned long mem_size = heap->pages * MY_PAGE_SIZE;
+    memset(heap->page_map, 0x0, heap->page_map_length * sizeof(PageEntry__));
+    memset(heap, 0x0, mem_size);
+    custom_sbrk(-mem_size);
 }
 
 
-void* heap_realloc(void* memblock, size_t count) {
-    if ((long long)count < 0 || (!memblock && !count) || heap_validate()) return NULL;
-    if (!memblock) return heap_malloc(count);
-    if (get_pointer_type(memblock) != pointer_valid) return NULL;
-    if (count == 0) return heap_free(memblock), NULL;
-    Header__ *handler = (Header__*)((uint8_t*)memblock - FENCE_LENGTH - CONTROL_STRUCT_SIZE);
+/* Pages the main heap grows by at once, growth_percent of its size kept between growth_min and growth_max */
+static size_t growth_step(Heap__ *heap) {
+    size_t step = heap->pages * MY_PAGE_SIZE / 100 * growth_percent;
+    step = step < growth_min ? growth_min : step > growth_max ? growth_max : step;
+    return step / MY_PAGE_SIZE;
+}
 
-    if (count < handler->mem_size) {
-        handler->mem_size = count;
-        fill_fences(handler);
-        return handler->user_mem_ptr;
-    } else if (count == handler->mem_size) {
-        update_header_control_sum(handler);
-        return handler->user_mem_ptr;
+
+/*
+ * The main heap moves the break, at least by a growth step so that a heap growing steadily calls custom_sbrk() rarely,
+ * falling back to the missing pages alone when there's no room for the step. Arenas commit pages of their mapping.
+ */
+static int request_more_space(Heap__ *heap, int pages_to_allocate) {
+    size_t pages = (size_t)pages_to_allocate, limit = heap->max_pages ? heap->max_pages : heap->page_map_length;
+    if (pages < 1) pages = 1;
+    if (heap->pages + pages > limit) return REQUEST_SPACE_FAIL;
+
+    if (!heap->max_pages) {
+        size_t step = growth_step(heap);
+        if (step > limit - heap->pages) step = limit - heap->pages;
+        if (step <= pages || custom_sbrk(MY_PAGE_SIZE * step) == SBRK_FAIL) {
+            if (custom_sbrk(MY_PAGE_SIZE * pages) == SBRK_FAIL) return REQUEST_SPACE_FAIL;
+        } else {
+            pages = step;
+        }
     }
+    heap->pages += pages;
+    heap->growths++;
+    heap->grown_bytes += pages * MY_PAGE_SIZE;
+    return 0;
+}
 
-    if (!handler->next) {
-        long long left_mem = calc_ptrs_distance((uint8_t*)handler->user_mem_ptr + handler->mem_size, (uint8_t*)heap + heap->pages * MY_PAGE_SIZE - FENCE_LENGTH);
 
-        if (left_mem < (long long)count) {
-            int pages_to_allocate = (int)((long long)count - left_mem) / MY_PAGE_SIZE + ((((long long)count - left_mem) / MY_PAGE_SIZE) % MY_PAGE_SIZE != 0);
-            pages_to_allocate = pages_to_allocate == 0 ? 1 : pages_to_allocate;
-            if (REQUEST_SPACE_FAIL == request_more_space(pages_to_allocate)) return NULL;
-        }
+static void update_heap_info(Heap__ *heap) {
+    heap->headers_allocated++;
+    heap->control_sum += 2 * FENCE_LENGTH;
+}
 
-        handler->mem_size = count;
-        fill_fences(handler);
-        return handler->user_mem_ptr;
-    } else if (handler->next->is_free && handler->mem_size + handler->next->mem_size > count) {
-        Header__ *reduced = (Header__*)((uint8_t*)handler->user_mem_ptr + count + FENCE_LENGTH);
-        long long reduced_size = (long long)(handler->mem_size + handler->next->mem_size - count);
-        Header__ copy;
 
-        memcpy(&copy, handler->next, sizeof(Header__));
-        reduced->next = copy.next;
+/* Every block's extent ends with its right fence, so the fences also push back the heap's clean memory */
+static void fill_fences(Heap__ *heap, Header__ *header) {
+    uint8_t *end = (uint8_t*)USER_MEM_PTR(header) + header->mem_size + FENCE_LENGTH;
+    memset((uint8_t*)header + CONTROL_STRUCT_SIZE, 'f', FENCE_LENGTH);
+    memset(end - FENCE_LENGTH, 'F', FENCE_LENGTH);
+    update_header_control_sum(header);
+    if ((uint8_t*)header >= (uint8_t*)heap + heap->pages * MY_PAGE_SIZE) return;
+    if (end > heap->clean) heap->clean = end;
+    if (!header->next) heap->tail_end = end;
+}
 
-        if (copy.next) {
-            copy.next->prev = reduced;
-            update_header_control_sum(copy.next);
-        }
-        reduced->prev= handler;
-        reduced->mem_size = reduced_size;
-        reduced->is_free = true;
-        reduced->user_mem_ptr = (uint8_t*)reduced + FENCE_LENGTH + CONTROL_STRUCT_SIZE;
-        fill_fences(reduced);
 
-        handler->next = reduced;
-        handler->mem_size = count;
-        fill_fences(handler);
+/* Where a header following a block of mem_size bytes goes, the first aligned address past its right fence */
+static Header__* header_after(Header__ *header, size_t mem_size) {
+    return (Header__*)ALIGN_UP((uintptr_t)USER_MEM_PTR(header) + mem_size + FENCE_LENGTH);
+}
 
-        return handler->user_mem_ptr;
-    } else if (handler->next->is_free && calc_ptrs_distance(handler->user_mem_ptr, (uint8_t*)handler->next->user_mem_ptr + handler->next->mem_size) > (long long)count) {
 
-        if (handler->next->next){
-            handler->next->next->prev = handler;
-            update_header_control_sum(handler->next->next);
-        }
+static size_t bin_index(size_t mem_size) {
+    if (mem_size < SMALL_BINS_LIMIT) return mem_size / BIN_GRANULARITY;
+    size_t bin = SMALL_BINS_COUNT + (63 - __builtin_clzll((unsigned long long)mem_size)) - 8;
+    return bin < BINS_COUNT ? bin : BINS_COUNT - 1;
+}
 
-        handler->next = handler->next->next;
-        handler->mem_size = count;
-        fill_fences(handler);
-        heap->control_sum -= 6;
-        heap->headers_allocated--;
-        return handler->user_mem_ptr;
-    }
 
-    void *ptr = heap_malloc(count);
-    if (!ptr) {
-        return NULL;
-    }
+#define FREE_NODE(header) ((FreeNode__*)USER_MEM_PTR(header))
 
-    memcpy(ptr, handler->user_mem_ptr, handler->mem_size);
-    heap_free(handler->user_mem_ptr);
-    update_header_control_sum((Header__ *) ((uint8_t *) ptr - CONTROL_STRUCT_SIZE - FENCE_LENGTH));
-    return ptr;
+
+static bool in_free_tree(size_t mem_size) {
+    return HEAP_FREE_TREE && mem_size >= HEAP_FREE_TREE_MIN;
 }
 
 
-static void join_forward(Header__ *current) {
-    Header__ *nxt = current->next;
-    current->mem_size += HEADER_SIZE(nxt->mem_size);
-    current->next = nxt->next;
-    if (nxt->next) {
-        nxt->next->prev = current;
-        update_header_control_sum(nxt->next);
-    }
-    update_header_control_sum(current);
-    heap->control_sum -= FENCE_LENGTH * 2;
-    heap->headers_allocated--;
+/* Blocks of the same size are ordered by address, so that best-fit prefers the lowest one */
+static bool tree_before(const Header__ *header, const Header__ *node) {
+    return header->mem_size < node->mem_size || (header->mem_size == node->mem_size && header < node);
 }
 
 
-static Header__* join_backward(Header__ *current) {
-    Header__ *prv = current->prev;
-    prv->mem_size += HEADER_SIZE(current->mem_size);
-    prv->next = current->next;
-    if (current->next) {
-        current->next->prev = prv;
-        update_header_control_sum(current->next);
-    }
-    update_header_control_sum(current);
-    heap->control_sum -= FENCE_LENGTH * 2;
-    heap->headers_allocated--;
-    return prv;
+static size_t tree_height(Header__ *node) {
+    return node ? FREE_NODE(node)->height : 0;
 }
 
-/* From [...cccfffUUUFFFcccfffUUUUFFF...] to [...cccfffUUUUUUUUUUUUUUUUFFF...] */
-void heap_free(void* memblock) {
-    if (HEAP_UNINITIALIZED == heap_validate() || !memblock || get_pointer_type(memblock) != pointer_valid) return;
 
-    Header__ *handler = (Header__*)((uint8_t*)memblock - FENCE_LENGTH - CONTROL_STRUCT_SIZE);
-    handler->is_free = true;
+static void tree_update_height(Header__ *node) {
+    size_t left = tree_height(FREE_NODE(node)->left), right = tree_height(FREE_NODE(node)->right);
+    FREE_NODE(node)->height = (left > right ? left : right) + 1;
+}
 
-    Header__ *nxt = handler->next;
-    Header__ *prv = handler->prev;
 
-    if (prv && prv->is_free) handler = join_backward(handler);
-    if (nxt && nxt->is_free) join_forward(handler);
-    if (handler->next) {
-        handler->mem_size = calc_ptrs_distance(handler, handler->next) - HEADER_SIZE(0);
-    }
-    fill_fences(handler);
+static Header__* tree_rotate_right(Header__ *node) {
+    Header__ *pivot = FREE_NODE(node)->left;
+    FREE_NODE(node)->left = FREE_NODE(pivot)->right;
+    FREE_NODE(pivot)->right = node;
+    tree_update_height(node);
+    tree_update_height(pivot);
+    return pivot;
 }
 
 
-static bool check_address(const void * const ptr) {
-    return ((intptr_t)ptr & (intptr_t)(PAGE_SIZE - 1)) == 0;
+static Header__* tree_rotate_left(Header__ *node) {
+    Header__ *pivot = FREE_NODE(node)->right;
+    FREE_NODE(node)->right = FREE_NODE(pivot)->left;
+    FREE_NODE(pivot)->left = node;
+    tree_update_height(node);
+    tree_update_height(pivot);
+    return pivot;
 }
 
 
-void* heap_malloc_aligned(size_t count) {
-    if (count < 1 || heap_validate() || HEADER_SIZE(count) < count) return NULL;
-    //Heap has no blocks at all
-    if (!heap->head) {
-        if (heap->pages * MY_PAGE_SIZE - sizeof(Heap__) < HEADER_SIZE(count) + MY_PAGE_SIZE) {
-            int pages_to_allocate = (int)HEADER_SIZE(count) / MY_PAGE_SIZE + ((int)HEADER_SIZE(count) % PAGE_SIZE != 0);
-            if (REQUEST_SPACE_FAIL == request_more_space(pages_to_allocate)) return NULL;
+/* Restores the balance of a subtree whose children differ in height by two at most, returns its new root */
+static Header__* tree_balance(Header__ *node) {
+    FreeNode__ *links = FREE_NODE(node);
+    tree_update_height(node);
+    if (tree_height(links->left) > tree_height(links->right) + 1) {
+        if (tree_height(FREE_NODE(links->left)->right) > tree_height(FREE_NODE(links->left)->left)) {
+            links->left = tree_rotate_left(links->left);
         }
-
-        heap->head = (Header__*)((uint8_t*)heap + MY_PAGE_SIZE - FENCE_LENGTH - CONTROL_STRUCT_SIZE);
-        set_header(heap->head, count, NULL, NULL);
-        return heap->head->user_mem_ptr;
+        return tree_rotate_right(node);
     }
-
-    //Search for perfect block existing already on heap
-    Header__ *iterator = heap->head;
-    while (iterator) {
-        if (iterator->is_free && check_address((uint8_t*)iterator + CONTROL_STRUCT_SIZE + FENCE_LENGTH) && iterator->mem_size == count) {
-            iterator->is_free = false;
-            fill_fences(iterator);
-            return iterator->user_mem_ptr;
-        } else if (iterator->is_free && check_address((uint8_t*)iterator + CONTROL_STRUCT_SIZE + FENCE_LENGTH) && iterator->mem_size > HEADER_SIZE(count) + 1) { //At least one byte for splittedheader's user mem
-            split_headers(iterator, count);
-            return iterator->user_mem_ptr;
-        } else if (iterator->is_free && check_address((uint8_t*)iterator + CONTROL_STRUCT_SIZE + FENCE_LENGTH) && iterator->mem_size > count) {
-            //Set new size and put new right fences, lost memory will be reverted on heap_free()
-            iterator->mem_size = count;
-            iterator->is_free = false;
-            fill_fences(iterator);
-            return iterator->user_mem_ptr;
+    if (tree_height(links->right) > tree_height(links->left) + 1) {
+        if (tree_height(FREE_NODE(links->right)->left) > tree_height(FREE_NODE(links->right)->right)) {
+            links->right = tree_rotate_right(links->right);
         }
-        iterator = iterator->next;
+        return tree_rotate_left(node);
     }
+    return node;
+}
 
-    //Create header between last node and end of heap memory
-    Header__ *last_header = last();
-    Header__ *end_of_last = (Header__*)((uint8_t*)last_header->user_mem_ptr + last_header->mem_size + FENCE_LENGTH);
-    long long free_mem_size = calc_ptrs_distance(end_of_last, (uint8_t*)heap + heap->pages * MY_PAGE_SIZE);
 
-    int pages_to_allocate = HEADER_SIZE(count) / MY_PAGE_SIZE;
-    pages_to_allocate += HEADER_SIZE(count) % MY_PAGE_SIZE != 0;
-    bool is_smaller = false;
-    if (free_mem_size < (long long)CONTROL_STRUCT_SIZE + FENCE_LENGTH) {
-        pages_to_allocate += 1;
-        is_smaller = true;
+static Header__* tree_insert(Header__ *root, Header__ *header) {
+    if (!root) {
+        FREE_NODE(header)->left = FREE_NODE(header)->right = NULL;
+        FREE_NODE(header)->height = 1;
+        return header;
     }
-
-    if (REQUEST_SPACE_FAIL == request_more_space(pages_to_allocate)) return NULL;
-    Header__ *new_header = (Header__*)((uint8_t*)end_of_last + free_mem_size - FENCE_LENGTH - CONTROL_STRUCT_SIZE + is_smaller * PAGE_SIZE);
-
-    set_header(new_header, count, last_header, NULL);
-    return new_header->user_mem_ptr;
+    if (tree_before(header, root)) FREE_NODE(root)->left = tree_insert(FREE_NODE(root)->left, header);
+    else FREE_NODE(root)->right = tree_insert(FREE_NODE(root)->right, header);
+    return tree_balance(root);
 }
 
 
-void* heap_calloc_aligned(size_t number, size_t size) {
-    void *handler = heap_malloc_aligned(number * size);
-    if (!handler) return NULL;
-    memset(handler, 0x0, number * size);
-    return handler;
+static Header__* tree_remove_smallest(Header__ *root, Header__ **smallest) {
+    if (!FREE_NODE(root)->left) {
+        *smallest = root;
+        return FREE_NODE(root)->right;
+    }
+    FREE_NODE(root)->left = tree_remove_smallest(FREE_NODE(root)->left, smallest);
+    return tree_balance(root);
 }
 
 
-void* heap_realloc_aligned(void* memblock, size_t size) {
-    if ((long long)size < 0 || (!memblock && !size) || heap_validate()) return NULL;
-    if (!memblock) return heap_malloc_aligned(size);
-    if (get_pointer_type(memblock) != pointer_valid) return NULL;
-    if (size == 0) return heap_free(memblock), NULL;
-    Header__ *handler = (Header__*)((uint8_t*)memblock - FENCE_LENGTH - CONTROL_STRUCT_SIZE);
-
-    if (size < handler->mem_size) {
-        handler->mem_size = size;
-        fill_fences(handler);
-        return handler->user_mem_ptr;
-    } else if (size == handler->mem_size) {
-        return handler->user_mem_ptr;
+/* The block has to be in the tree with the size it was inserted with */
+static Header__* tree_remove(Header__ *root, Header__ *header) {
+    FreeNode__ *links = FREE_NODE(root);
+    if (root != header) {
+        if (tree_before(header, root)) links->left = tree_remove(links->left, header);
+        else links->right = tree_remove(links->right, header);
+        return tree_balance(root);
     }
+    if (!links->left || !links->right) return links->left ? links->left : links->right;
 
-    if (!handler->next) {
-        long long left_mem = calc_ptrs_distance((uint8_t *) handler->user_mem_ptr + handler->mem_size,
-                                                (uint8_t *) heap + heap->pages * MY_PAGE_SIZE - FENCE_LENGTH);
-
-        if (left_mem < (long long) size) {
-            int pages_to_allocate = (int) ((long long) size - left_mem) / MY_PAGE_SIZE +
-                                    ((((long long) size - left_mem) / MY_PAGE_SIZE) % MY_PAGE_SIZE != 0);
-            pages_to_allocate = pages_to_allocate == 0 ? 1 : pages_to_allocate;
-            if (REQUEST_SPACE_FAIL == request_more_space(pages_to_allocate)) return NULL;
-        }
-        handler->mem_size = size;
-        fill_fences(handler);
-        return handler->user_mem_ptr;
-
-    } else if (calc_ptrs_distance(handler->user_mem_ptr, handler->next) - FENCE_LENGTH > (long long)size) {
-        handler->mem_size = size;
-        fill_fences(handler);
-        return handler->user_mem_ptr;
-    } else if (handler->next->is_free && handler->mem_size + handler->next->mem_size > size) {
-        Header__ *reduced = (Header__*)((uint8_t*)handler->user_mem_ptr + size + FENCE_LENGTH);
-        long long reduced_size = (long long)(handler->mem_size + handler->next->mem_size - size);
-        Header__ copy;
+    Header__ *successor;
+    Header__ *right = tree_remove_smallest(links->right, &successor);
+    FREE_NODE(successor)->left = links->left;
+    FREE_NODE(successor)->right = right;
+    return tree_balance(successor);
+}
 
-        memcpy(&copy, handler->next, sizeof(Header__));
-        reduced->next = copy.next;
 
-        if (copy.next) {
-            copy.next->prev = reduced;
-            update_header_control_sum(copy.next);
+/* The smallest block of at least size bytes, the lowest one of its size */
+static Header__* tree_best_fit(Header__ *root, size_t size) {
+    Header__ *best = NULL;
+    while (root) {
+        if (root->mem_size >= size) {
+            best = root;
+            root = FREE_NODE(root)->left;
+        } else {
+            root = FREE_NODE(root)->right;
         }
+    }
+    return best;
+}
 
-        reduced->prev= handler;
-        reduced->mem_size = reduced_size;
-        reduced->is_free = true;
-        reduced->user_mem_ptr = (uint8_t*)reduced + FENCE_LENGTH + CONTROL_STRUCT_SIZE;
-        fill_fences(reduced);
-
-        handler->next = reduced;
-        handler->mem_size = size;
-        fill_fences(handler);
-        return handler->user_mem_ptr;
-    } else if (handler->next->is_free && calc_ptrs_distance(handler->user_mem_ptr, (uint8_t*)handler->next->user_mem_ptr + handler->next->mem_size) > (long long)size) {
 
-        if (handler->next->next) {
-            handler->next->next->prev = handler;
-            update_header_control_sum(handler->next->next);
+static void bin_insert(Heap__ *heap, Header__ *header) {
+    size_t bin = bin_index(header->mem_size);
+    header->prev_free = header->next_free = NULL;
+    if (in_free_tree(header->mem_size)) {
+        heap->free_tree = tree_insert(heap->free_tree, header);
+    } else {
+        header->next_free = heap->bins[bin];
+        if (header->next_free) {
+            header->next_free->prev_free = header;
+            update_header_control_sum(header->next_free);
         }
+        heap->bins[bin] = header;
+        heap->bins_map |= 1ULL << bin;
+    }
+    heap->bin_counts[bin]++;
+    heap->free_blocks++;
+    heap->free_bytes += header->mem_size;
+    update_header_control_sum(header);
+}
 
-        handler->next = handler->next->next;
-        handler->mem_size = size;
-        fill_fences(handler);
 
-        heap->control_sum -= 6;
-        heap->headers_allocated--;
-        return handler->user_mem_ptr;
+static void bin_remove(Heap__ *heap, Header__ *header) {
+    size_t bin = bin_index(header->mem_size);
+    if (in_free_tree(header->mem_size)) {
+        heap->free_tree = tree_remove(heap->free_tree, header);
+    } else if (header->prev_free) {
+        header->prev_free->next_free = header->next_free;
+        update_header_control_sum(header->prev_free);
+    } else {
+        heap->bins[bin] = header->next_free;
+        if (!heap->bins[bin]) heap->bins_map &= ~(1ULL << bin);
     }
-
-    void *ptr = heap_malloc_aligned(size);
-    if (!ptr) {
-        return NULL;
+    if (header->next_free) {
+        header->next_free->prev_free = header->prev_free;
+        update_header_control_sum(header->next_free);
     }
-
-    memcpy(ptr, handler->user_mem_ptr, handler->mem_size);
-    heap_free(handler->user_mem_ptr);
-    update_header_control_sum((Header__ *) ((uint8_t *) ptr - CONTROL_STRUCT_SIZE - FENCE_LENGTH));
-    return ptr;
+    header->prev_free = header->next_free = NULL;
+    heap->bin_counts[bin]--;
+    heap->free_blocks--;
+    heap->free_bytes -= header->mem_size;
+    update_header_control_sum(header);
 }
 
 
-size_t heap_get_largest_used_block_size(void) {
+/*
+ * Every block in bins above the size's own bin is big enough, so only the first bin is scanned.
+ * The tree is searched best-fit when the bins have nothing, and right away for sizes it holds.
+ */
+static Header__* find_free_block(Heap__ *heap, size_t size) {
+    Header__ *iterator = NULL;
+    if (!in_free_tree(size)) {
+        //A bin holds sizes up to twice its smallest one, so only a few of its blocks are tried, any larger bin fits
+        size_t bin = bin_index(size);
+        iterator = heap->bins[bin];
+        for (unsigned tried = 0; iterator && tried < BIN_SCAN_LIMIT; iterator = iterator->next_free, tried++) {
+            if (iterator->mem_size >= size) return iterator;
+        }
+        uint64_t candidates = bin + 1 < BINS_COUNT ? heap->bins_map & (~0ULL << (bin + 1)) : 0;
+        if (candidates) return heap->bins[__builtin_ctzll(candidates)];
+    }
+    Header__ *fit = tree_best_fit(heap->free_tree, size);
 
-    if (!heap || !heap->head || heap_validate()) return 0;
+    //Nothing larger is free, the rest of the bin is searched before the heap grows
+    for (; !fit && iterator; iterator = iterator->next_free) {
+        if (iterator->mem_size >= size) fit = iterator;
+    }
+    return fit;
+}
 
-    size_t max = 0;
-    Header__ *iterator = heap->head;
 
-    while (iterator) {
-        if (!iterator->is_free) {
-            max = iterator->mem_size > max ? iterator->mem_size : max;
-        }
-        iterator = iterator->next;
+static void set_header(Heap__ *heap, Header__ *header, const size_t mem_size, Header__ *prv, Header__ *nxt) {
+    header->is_free = false;
+    header->prev_free = NULL;
+    header->next_free = NULL;
+    header->mem_size = mem_size;
+    header->prev = prv;
+    header->next = nxt;
+    if (prv){
+        prv->next = header;
+        update_header_control_sum(prv);
     }
-    return max;
+    if (nxt){
+        nxt->prev = header, update_header_control_sum(nxt);
+    }
+    fill_fences(heap, header);
+    page_map_add(heap, header);
+    update_heap_info(heap);
 }
 
 
-enum pointer_type_t get_pointer_type(const void* const pointer) {
-    if (!pointer) return pointer_null;
-    if (heap_validate() == HEAP_CORRUPTED) return pointer_heap_corrupted;
+/*
+ * From [.....cccfffUUUUUUUUUUUUUUFFF.......] to  [.....cccfffUUUFFF|cccfffUUFFF........]
+ *      [       FREE HEADER BLOCK           ] to [Occupied header^  ^FREE HEADER BLOCK  ]
+ *
+ * c - control struct
+ * f - left fence
+ * U - user's memory
+ * F - right fence
+*/
+static void split_headers(Heap__ *heap, Header__ *header_to_reduce, size_t new_mem_size) {
+    uint8_t *user_mem_end = (uint8_t*)USER_MEM_PTR(header_to_reduce) + header_to_reduce->mem_size;
+    Header__ *remaining_header = header_after(header_to_reduce, new_mem_size);
+
+    header_to_reduce->is_free = false;
+    header_to_reduce->mem_size = new_mem_size;
+    fill_fences(heap, header_to_reduce);
+
+    set_header(heap, remaining_header, user_mem_end - (uint8_t*)USER_MEM_PTR(remaining_header), header_to_reduce, header_to_reduce->next);
+    remaining_header->is_free = true;
+    header_to_reduce->next = remaining_header;
+    bin_insert(heap, remaining_header);
+    update_header_control_sum(header_to_reduce);
+}
+
+/* header - memory layout - control fences user_space fences  */
+/*
+ * Slabs: page-aligned blocks carved into equal slots of one size class, with no headers or fences per slot.
+ * The descriptor sits at the start of the page and the page map tells slab pages apart.
+ */
+static bool slabs_enabled() {
+    return HEAP_SLABS && check_mode != heap_check_full;
+}
+
+
+static Slab__* slab_of(Heap__ *heap, const void *address) {
+    if ((intptr_t)address < (intptr_t)heap) return NULL;
+    size_t page = page_of(heap, address);
+    return page < heap->page_map_length ? heap->page_map[page].slab : NULL;
+}
+
+
+static void slab_link(Heap__ *heap, Slab__ *slab) {
+    Slab__ **list = heap->slabs + slab->slot_size / BIN_GRANULARITY - 1;
+    slab->prev_partial = NULL;
+    slab->next_partial = *list;
+    if (*list) (*list)->prev_partial = slab;
+    *list = slab;
+}
+
+
+static void slab_unlink(Heap__ *heap, Slab__ *slab) {
+    if (slab->prev_partial) slab->prev_partial->next_partial = slab->next_partial;
+    else heap->slabs[slab->slot_size / BIN_GRANULARITY - 1] = slab->next_partial;
+    if (slab->next_partial) slab->next_partial->prev_partial = slab->prev_partial;
+    slab->prev_partial = slab->next_partial = NULL;
+}
+
+
+static Slab__* slab_create(Heap__ *heap, size_t class) {
+    Slab__ *slab = malloc_aligned_unlocked(heap, MY_PAGE_SIZE, MY_PAGE_SIZE);
+    if (!slab) return NULL;
+
+    slab->slot_size = (class + 1) * BIN_GRANULARITY;
+    slab->first_slot = (sizeof(Slab__) + BIN_GRANULARITY - 1) / BIN_GRANULARITY * BIN_GRANULARITY;
+    slab->slots = (MY_PAGE_SIZE - slab->first_slot) / slab->slot_size;
+    slab->used = 0;
+    uint64_t taken[SLAB_BITMAP_WORDS];
+    memset(taken, 0xFF, sizeof(taken));
+    for (size_t slot = 0; slot < slab->slots; slot++) taken[slot / 64] &= ~(1ULL << slot % 64);
+    for (size_t word = 0; word < SLAB_BITMAP_WORDS; word++) {
+        atomic_init(slab->taken + word, taken[word]);
+        atomic_init(slab->cached + word, 0);
+    }
+
+    heap->page_map[page_of(heap, slab)].slab = slab;
+    slab_link(heap, slab);
+    return slab;
+}
+
+
+/* Bitmaps are only written under the lock, but thread cache frees read them without it */
+static uint64_t slab_word(_Atomic uint64_t *bitmap, size_t word) {
+    return atomic_load_explicit(bitmap + word, memory_order_relaxed);
+}
+
+
+static bool slab_bit(_Atomic uint64_t *bitmap, size_t slot) {
+    return slab_word(bitmap, slot / 64) >> slot % 64 & 1;
+}
+
+
+static void* slab_malloc(Heap__ *heap, size_t size) {
+    size_t class = (size - 1) / BIN_GRANULARITY;
+    Slab__ *slab = heap->slabs[class] ? heap->slabs[class] : slab_create(heap, class);
+    if (!slab) return NULL;
+
+    size_t word = 0;
+    while (!~slab_word(slab->taken, word)) word++;
+    size_t slot = word * 64 + __builtin_ctzll(~slab_word(slab->taken, word));
+    atomic_store_explicit(slab->taken + word, slab_word(slab->taken, word) | 1ULL << slot % 64, memory_order_relaxed);
+    if (++slab->used == slab->slots) slab_unlink(heap, slab);
+    return (uint8_t*)slab + slab->first_slot + slot * slab->slot_size;
+}
+
+
+/* Slots parked in a thread cache are taken, but neither allocated nor free until they leave the cache */
+static bool is_slot_allocated(Slab__ *slab, size_t slot) {
+    return slot < slab->slots && slab_bit(slab->taken, slot) && !slab_bit(slab->cached, slot);
+}
+
+
+/* Slots handed out and not parked in a thread cache since */
+static size_t slab_allocated_slots(Slab__ *slab) {
+    size_t cached = 0;
+    for (size_t word = 0; word < SLAB_BITMAP_WORDS; word++) cached += __builtin_popcountll(slab_word(slab->cached, word));
+    return slab->used - cached;
+}
+
+
+/* Index of the allocated slot starting at address, slab->slots for anything else */
+static size_t slab_slot(Slab__ *slab, const void *address) {
+    intptr_t offset = (intptr_t)address - (intptr_t)slab - slab->first_slot;
+    if (offset < 0 || offset % slab->slot_size) return slab->slots;
+    size_t slot = (size_t)offset / slab->slot_size;
+    return is_slot_allocated(slab, slot) ? slot : slab->slots;
+}
+
+
+static enum pointer_type_t slab_pointer_type(Slab__ *slab, const void *address) {
+    intptr_t offset = (intptr_t)address - (intptr_t)slab - slab->first_slot;
+    if (offset < 0) return pointer_control_block;
+    if (!is_slot_allocated(slab, (size_t)offset / slab->slot_size)) return pointer_unallocated;
+    return offset % slab->slot_size ? pointer_inside_data_block : pointer_valid;
+}
+
+
+static void slab_free(Heap__ *heap, Slab__ *slab, void *memblock) {
+    size_t slot = slab_slot(slab, memblock);
+    if (slot == slab->slots) return;
+
+    atomic_store_explicit(slab->taken + slot / 64, slab_word(slab->taken, slot / 64) & ~(1ULL << slot % 64), memory_order_relaxed);
+    if (slab->used-- == slab->slots) slab_link(heap, slab);
+
+    //Empty slabs go back to the block allocator, the last one with free slots stays for its class
+    if (!slab->used && (slab->prev_partial || slab->next_partial)) {
+        slab_unlink(heap, slab);
+        heap->page_map[page_of(heap, slab)].slab = NULL;
+        free_unlocked(heap, slab);
+    }
+}
+
+
+/* Slots never grow in place, bigger sizes and stricter alignments move the data out of the slab */
+static void* slab_realloc(Heap__ *heap, Slab__ *slab, void *memblock, size_t count, size_t alignment) {
+    if (alignment <= MEMORY_ALIGNMENT && count <= slab->slot_size) return memblock;
+    void *ptr = malloc_aligned_unlocked(heap, count, alignment);
+    if (!ptr) return NULL;
+    memcpy(ptr, memblock, count < slab->slot_size ? count : slab->slot_size);
+    slab_free(heap, slab, memblock);
+    return ptr;
+}
+
+
+/*
+ * Large blocks: from mmap_threshold bytes up, blocks of the main heap get a custom_mmap() mapping of their own,
+ * given back on free instead of fragmenting the brk heap. They are linked through prev and next on heap->large,
+ * the header sits as far into the first page as the user memory's alignment needs, and the mapping's length
+ * follows from the header's offset and mem_size. Arenas keep everything in their single mapping.
+ */
+static bool is_large_size(Heap__ *heap, size_t size) {
+    //A mapping takes whole pages, blocks up to a page (slabs among them) always stay in the heap
+    return !heap->max_pages && mmap_threshold && size >= mmap_threshold && size > MY_PAGE_SIZE;
+}
+
+
+static size_t large_length(Header__ *header) {
+    size_t offset = (uintptr_t)header & (MY_PAGE_SIZE - 1);
+    return (offset + HEADER_SIZE(header->mem_size) + MY_PAGE_SIZE - 1) & ~(size_t)(MY_PAGE_SIZE - 1);
+}
+
+
+static void* large_malloc(Heap__ *heap, size_t count, size_t alignment) {
+    size_t user_offset = (CONTROL_STRUCT_SIZE + FENCE_LENGTH + alignment - 1) & ~(alignment - 1);
+    if (count > SIZE_MAX - user_offset - FENCE_LENGTH - MY_PAGE_SIZE) return NULL;
+    uint8_t *mapping = custom_mmap((user_offset + count + FENCE_LENGTH + MY_PAGE_SIZE - 1) & ~(size_t)(MY_PAGE_SIZE - 1));
+    if (mapping == SBRK_FAIL) return NULL;
+
+    Header__ *header = (Header__*)(mapping + user_offset - FENCE_LENGTH - CONTROL_STRUCT_SIZE);
+    header->prev = NULL;
+    header->next = heap->large;
+    header->prev_free = NULL;
+    header->next_free = NULL;
+    header->mem_size = count;
+    header->is_free = false;
+    if (heap->large) {
+        heap->large->prev = header;
+        update_header_control_sum(heap->large);
+    }
+    heap->large = header;
+    heap->large_blocks++;
+    heap->large_bytes += count;
+    heap->large_mapped += large_length(header);
+    fill_fences(heap, header);
+    return USER_MEM_PTR(header);
+}
+
+
+static bool is_outside_heap(Heap__ *heap, const void *address) {
+    return (intptr_t)address < (intptr_t)heap || (intptr_t)address >= (intptr_t)((uint8_t*)heap + heap->pages * MY_PAGE_SIZE);
+}
+
+
+/* Large block whose mapping holds the address, NULL for anything else */
+static Header__* large_of(Heap__ *heap, const void *address) {
+    for (Header__ *iterator = heap->large; iterator; iterator = iterator->next) {
+        uintptr_t mapping = (uintptr_t)iterator & ~(uintptr_t)(MY_PAGE_SIZE - 1);
+        if ((uintptr_t)address >= mapping && (uintptr_t)address < mapping + large_length(iterator)) return iterator;
+    }
+    return NULL;
+}
+
+
+static void large_free(Heap__ *heap, Header__ *header) {
+    if (header->prev) {
+        header->prev->next = header->next;
+        update_header_control_sum(header->prev);
+    } else {
+        heap->large = header->next;
+    }
+    if (header->next) {
+        header->next->prev = header->prev;
+        update_header_control_sum(header->next);
+    }
+    heap->large_blocks--;
+    heap->large_bytes -= header->mem_size;
+    heap->large_mapped -= large_length(header);
+    custom_munmap((void*)((uintptr_t)header & ~(uintptr_t)(MY_PAGE_SIZE - 1)), large_length(header));
+}
+
+
+/*
+ * Large blocks are resized by remapping their pages, the data is copied only when the block
+ * drops under the threshold or its user memory is not at the alignment
+ */
+static void* large_realloc(Heap__ *heap, Header__ *header, size_t count, size_t alignment) {
+    if (is_large_size(heap, count) && !((uintptr_t)USER_MEM_PTR(header) & (alignment - 1))) {
+        size_t offset = (uintptr_t)header & (MY_PAGE_SIZE - 1);
+        size_t length = large_length(header);
+        size_t needed = (offset + HEADER_SIZE(count) + MY_PAGE_SIZE - 1) & ~(size_t)(MY_PAGE_SIZE - 1);
+        uint8_t *mapping = (uint8_t*)header - offset;
+        if (needed != length) mapping = custom_mremap(mapping, length, needed, 1);
+        if (mapping != SBRK_FAIL) {
+            header = (Header__*)(mapping + offset);
+            if (header->prev) {
+                header->prev->next = header;
+                update_header_control_sum(header->prev);
+            } else {
+                heap->large = header;
+            }
+            if (header->next) {
+                header->next->prev = header;
+                update_header_control_sum(header->next);
+            }
+            heap->large_bytes += count - header->mem_size;
+            heap->large_mapped += needed - length;
+            header->mem_size = count;
+            fill_fences(heap, header);
+            return USER_MEM_PTR(header);
+        }
+    }
+
+    void *ptr = malloc_aligned_unlocked(heap, count, alignment);
+    if (!ptr) return NULL;
+    memcpy(ptr, USER_MEM_PTR(header), count < header->mem_size ? count : header->mem_size);
+    large_free(heap, header);
+    return ptr;
+}
+
+
+/* Marks a free block taken out of the bins as used, the memory past size bytes becomes a free block when big enough */
+static void use_free_block(Heap__ *heap, Header__ *block, size_t size) {
+    if (block->mem_size == size) {
+        block->is_free = false;
+        update_header_control_sum(block);
+    } else if (block->mem_size > HEADER_SIZE(size) + MEMORY_ALIGNMENT) { //At least one byte for splittedheader's user mem, past the alignment
+        split_headers(heap, block, size);
+    } else {
+        //Set new size and put new right fences, lost memory will be reverted on heap_free()
+        block->mem_size = size;
+        block->is_free = false;
+        fill_fences(heap, block);
+    }
+    page_map_cover(heap, block, block);
+}
+
+
+/* A block with a header in the heap's pages, never a slab slot or a mapping of its own */
+static void* malloc_block(Heap__ *heap, size_t size) {
+    //Heap has no blocks at all
+    if (!heap->head) {
+        size_t available = heap->pages * MY_PAGE_SIZE - heap->control_size;
+        if (available < HEADER_SIZE(size)) {
+            int pages_to_allocate = (int)((HEADER_SIZE(size) - available + MY_PAGE_SIZE - 1) / MY_PAGE_SIZE);
+            if (REQUEST_SPACE_FAIL == request_more_space(heap, pages_to_allocate)) return NULL;
+        }
+        heap->head = (Header__*)((uint8_t*)heap + heap->control_size);
+        set_header(heap, heap->head, size, NULL, NULL);
+        page_map_cover(heap, heap->head, heap->head);
+        return USER_MEM_PTR(heap->head);
+    }
+
+    //Take a fitting block from the free bins
+    Header__ *iterator = find_free_block(heap, size);
+    if (iterator) {
+        bin_remove(heap, iterator);
+        use_free_block(heap, iterator, size);
+        return USER_MEM_PTR(iterator);
+    }
+
+    //Create header between last node and end of heap memory
+    Header__ *last_header = last(heap);
+
+    Header__ *new_header = header_after(last_header, last_header->mem_size);
+    long long free_mem_size = calc_ptrs_distance(new_header, (uint8_t*)heap + heap->pages * MY_PAGE_SIZE);
+
+    //The pages are added behind the last block, the search doesn't have to run again
+    if (free_mem_size <= (long long)(HEADER_SIZE(size))) {
+        int pages_to_allocate = (int)((HEADER_SIZE(size) - free_mem_size) / MY_PAGE_SIZE + (int)(((HEADER_SIZE(size) - free_mem_size)) % PAGE_SIZE != 0));
+        if (REQUEST_SPACE_FAIL == request_more_space(heap, pages_to_allocate)) return NULL;
+    }
+
+    set_header(heap, new_header, size, last_header, NULL);
+    page_map_cover(heap, new_header, new_header);
+    return USER_MEM_PTR(new_header);
+}
+
+
+static void* malloc_unchecked(Heap__ *heap, size_t size) {
+    if (size <= SLAB_MAX_SIZE && slabs_enabled()) {
+        void *slot = slab_malloc(heap, size);
+        if (slot) return slot;
+    }
+    if (is_large_size(heap, size)) {
+        void *ptr = large_malloc(heap, size, MEMORY_ALIGNMENT);
+        if (ptr) return ptr;
+    }
+    return malloc_block(heap, size);
+}
+
+
+static void* malloc_unlocked(Heap__ *heap, size_t size) {
+    if (size < 1 || heap_check(heap) || HEADER_SIZE(size) < size) return NULL;
+    drain_remote_frees(heap);
+    return malloc_unchecked(heap, size);
+}
+
+
+/* Large amounts go around the cache with non-temporal stores, the block would only evict the caller's working set */
+static void zero_memory(void *memory, size_t size) {
+#if defined(__SSE2__)
+    if (size >= HEAP_STREAM_ZERO_SIZE && !((uintptr_t)memory & (sizeof(__m128i) - 1))) {
+        __m128i *stream = memory;
+        for (size_t i = 0; i < size / sizeof(__m128i); i++) _mm_stream_si128(stream + i, _mm_setzero_si128());
+        _mm_sfence();
+        memset((uint8_t*)memory + size / sizeof(__m128i) * sizeof(__m128i), 0x0, size % sizeof(__m128i));
+        return;
+    }
+#endif
+    memset(memory, 0x0, size);
+}
+
+
+/* Only what may have been written gets zeroed: large blocks' mappings come zeroed, so does heap memory past heap->clean */
+static void* calloc_unlocked(Heap__ *heap, size_t number, size_t size, size_t alignment) {
+    if (!heap || (size && number > SIZE_MAX / size)) return NULL;
+    uint8_t *clean = heap->clean;
+    uint8_t *ptr = malloc_aligned_unlocked(heap, number * size, alignment);
+    if (!ptr || is_outside_heap(heap, ptr)) return ptr;
+
+    size_t dirty = ptr >= clean ? 0 : (size_t)(clean - ptr);
+    zero_memory(ptr, dirty < number * size ? dirty : number * size);
+    return ptr;
+}
+
+
+static void join_forward(Heap__ *heap, Header__ *current) {
+    Header__ *nxt = current->next;
+    bin_remove(heap, nxt);
+    forget_header(heap, nxt);
+    current->mem_size += HEADER_SIZE(nxt->mem_size);
+    current->next = nxt->next;
+    if (nxt->next) {
+        nxt->next->prev = current;
+        update_header_control_sum(nxt->next);
+    }
+    update_header_control_sum(current);
+    heap->control_sum -= FENCE_LENGTH * 2;
+    heap->headers_allocated--;
+}
+
+
+static Header__* join_backward(Heap__ *heap, Header__ *current) {
+    Header__ *prv = current->prev;
+    bin_remove(heap, prv);
+    forget_header(heap, current);
+    prv->mem_size += HEADER_SIZE(current->mem_size);
+    prv->next = current->next;
+    if (current->next) {
+        current->next->prev = prv;
+        update_header_control_sum(current->next);
+    }
+    update_header_control_sum(current);
+    heap->control_sum -= FENCE_LENGTH * 2;
+    heap->headers_allocated--;
+    return prv;
+}
+
+/*
+ * Moves the break back once a free last block leaves trim_threshold bytes or more unused at the end of the heap.
+ * Only trim_pad bytes, or a growth step when larger, stay behind it, so a heap swinging around the threshold
+ * doesn't call custom_sbrk() every time.
+ */
+static void trim(Heap__ *heap, Header__ *tail) {
+    if (heap->max_pages || !trim_threshold || tail->next || !tail->is_free) return;
+    uint8_t *user_mem = USER_MEM_PTR(tail);
+    uint8_t *heap_end = (uint8_t*)heap + heap->pages * MY_PAGE_SIZE;
+    if ((size_t)(heap_end - user_mem) < trim_threshold) return;
+
+    size_t kept = growth_step(heap) * MY_PAGE_SIZE > trim_pad ? growth_step(heap) * MY_PAGE_SIZE : trim_pad;
+    if (kept > (size_t)(heap_end - user_mem)) kept = heap_end - user_mem;
+    uint8_t *new_end = (uint8_t*)(((uintptr_t)user_mem + kept + FENCE_LENGTH + MY_PAGE_SIZE - 1) & ~(uintptr_t)(MY_PAGE_SIZE - 1));
+    if (new_end >= heap_end) return;
+    size_t pages = (heap_end - new_end) / MY_PAGE_SIZE;
+    if (custom_sbrk(-(intptr_t)(pages * MY_PAGE_SIZE)) == SBRK_FAIL) return;
+
+    bin_remove(heap, tail);
+    tail->mem_size = new_end - FENCE_LENGTH - user_mem;
+    fill_fences(heap, tail);
+    bin_insert(heap, tail);
+    heap->pages -= pages;
+    memset(heap->page_map + heap->pages, 0x0, pages * sizeof(PageEntry__));
+    if (heap->clean > new_end) heap->clean = new_end;   //The break comes back with zeroed pages
+}
+
+
+/*
+ * From [cccfffUUUUUUUUUUUUFFF|ccc...] to [cccfffUUUFFF|cccfffUUUUFFF|ccc...]
+ * Shrinks a used block in place, the memory it no longer needs becomes a free block merged with a free successor.
+ */
+static void shrink_block(Heap__ *heap, Header__ *handler, size_t count) {
+    page_map_cover(heap, handler, NULL);
+    if (handler->next) handler->mem_size = calc_ptrs_distance(USER_MEM_PTR(handler), handler->next) - FENCE_LENGTH;
+
+    if (handler->mem_size > HEADER_SIZE(count) + MEMORY_ALIGNMENT) { //At least one byte for splittedheader's user mem, past the alignment
+        split_headers(heap, handler, count);
+        Header__ *rest = handler->next;
+        if (rest->next && rest->next->is_free) {
+            bin_remove(heap, rest);
+            join_forward(heap, rest);
+            fill_fences(heap, rest);
+            bin_insert(heap, rest);
+        }
+        trim(heap, rest);
+    } else {
+        handler->mem_size = count;
+        fill_fences(heap, handler);
+    }
+    page_map_cover(heap, handler, handler);
+}
+
+
+/*
+ * From [cccfffFREEFFF|cccfffUUUFFF|...] to [cccfffUUUUUUUUUUUUFFF|...]
+ * Grows a block into its free predecessor, and the free successor too when needed, moving the data down with memmove().
+ * NULL when they don't make room enough or the predecessor's user memory is not at the alignment.
+ */
+static void* grow_backward(Heap__ *heap, Header__ *handler, size_t count, size_t alignment) {
+    Header__ *prv = handler->prev;
+    Header__ *nxt = handler->next;
+    if (!prv || !prv->is_free || !nxt || ((uintptr_t)USER_MEM_PTR(prv) & (alignment - 1))) return NULL;
+
+    uint8_t *end = nxt->is_free ? (uint8_t*)USER_MEM_PTR(nxt) + nxt->mem_size : (uint8_t*)nxt - FENCE_LENGTH;
+    if (end - (uint8_t*)USER_MEM_PTR(prv) < (long long)count) return NULL;
+    void *memblock = USER_MEM_PTR(handler);
+    size_t mem_size = handler->mem_size;
+
+    page_map_cover(heap, handler, NULL);
+    Header__ *block = join_backward(heap, handler);
+    if (nxt->is_free) join_forward(heap, block);
+    memmove(USER_MEM_PTR(block), memblock, mem_size);
+
+    block->mem_size = end - (uint8_t*)USER_MEM_PTR(block);
+    fill_fences(heap, block);
+    use_free_block(heap, block, count);
+    return USER_MEM_PTR(block);
+}
+
+
+/* Realloc's last resort: copies the block to a new one and frees it */
+static void* move_block(Heap__ *heap, Header__ *handler, size_t count, size_t alignment) {
+    void *ptr = malloc_aligned_unlocked(heap, count, alignment);
+    if (!ptr) return NULL;
+
+    memcpy(ptr, USER_MEM_PTR(handler), handler->mem_size < count ? handler->mem_size : count);
+    free_unlocked(heap, USER_MEM_PTR(handler));
+    return ptr;
+}
+
+
+static void* realloc_unlocked(Heap__ *heap, void* memblock, size_t count) {
+    if ((long long)count < 0 || (!memblock && !count) || heap_check(heap)) return NULL;
+    drain_remote_frees(heap);
+    if (!memblock) return malloc_unlocked(heap, count);
+    if (pointer_type_unlocked(heap, memblock) != pointer_valid) return NULL;
+    if (count == 0) return free_unlocked(heap, memblock), NULL;
+    Slab__ *slab = slab_of(heap, memblock);
+    if (slab) return slab_realloc(heap, slab, memblock, count, MEMORY_ALIGNMENT);
+    Header__ *handler = (Header__*)((uint8_t*)memblock - FENCE_LENGTH - CONTROL_STRUCT_SIZE);
+    if (is_outside_heap(heap, memblock)) return large_realloc(heap, handler, count, MEMORY_ALIGNMENT);
+    if (count > handler->mem_size && is_large_size(heap, count)) return move_block(heap, handler, count, MEMORY_ALIGNMENT);
+
+    if (count < handler->mem_size) {
+        shrink_block(heap, handler, count);
+        return USER_MEM_PTR(handler);
+    } else if (count == handler->mem_size) {
+        update_header_control_sum(handler);
+        return USER_MEM_PTR(handler);
+    }
+
+    if (!handler->next) {
+        long long left_mem = calc_ptrs_distance((uint8_t*)USER_MEM_PTR(handler) + handler->mem_size, (uint8_t*)heap + heap->pages * MY_PAGE_SIZE - FENCE_LENGTH);
+
+        if (left_mem < (long long)count) {
+            int pages_to_allocate = (int)((long long)count - left_mem) / MY_PAGE_SIZE + ((((long long)count - left_mem) / MY_PAGE_SIZE) % MY_PAGE_SIZE != 0);
+            pages_to_allocate = pages_to_allocate == 0 ? 1 : pages_to_allocate;
+            if (REQUEST_SPACE_FAIL == request_more_space(heap, pages_to_allocate)) return NULL;
+        }
+
+        handler->mem_size = count;
+        fill_fences(heap, handler);
+        page_map_cover(heap, handler, handler);
+        return USER_MEM_PTR(handler);
+    } else if (handler->next->is_free && (uint8_t*)USER_MEM_PTR(header_after(handler, count)) < (uint8_t*)USER_MEM_PTR(handler->next) + handler->next->mem_size) {
+        Header__ *reduced = header_after(handler, count);
+        long long reduced_size = calc_ptrs_distance(USER_MEM_PTR(reduced), (uint8_t*)USER_MEM_PTR(handler->next) + handler->next->mem_size);
+        Header__ copy;
+
+        bin_remove(heap, handler->next);
+        page_map_cover(heap, handler, NULL);
+        forget_header(heap, handler->next);
+        memcpy(&copy, handler->next, sizeof(Header__));
+        reduced->next = copy.next;
+
+        if (copy.next) {
+            copy.next->prev = reduced;
+            update_header_control_sum(copy.next);
+        }
+        reduced->prev= handler;
+        reduced->mem_size = reduced_size;
+        reduced->is_free = true;
+        fill_fences(heap, reduced);
+        bin_insert(heap, reduced);
+
+        handler->next = reduced;
+        handler->mem_size = count;
+        fill_fences(heap, handler);
+        page_map_add(heap, reduced);
+        page_map_cover(heap, reduced, NULL);
+        page_map_cover(heap, handler, handler);
+
+        return USER_MEM_PTR(handler);
+    } else if (handler->next->is_free && calc_ptrs_distance(USER_MEM_PTR(handler), (uint8_t*)USER_MEM_PTR(handler->next) + handler->next->mem_size) > (long long)count) {
+        bin_remove(heap, handler->next);
+        forget_header(heap, handler->next);
+
+        if (handler->next->next){
+            handler->next->next->prev = handler;
+            update_header_control_sum(handler->next->next);
+        }
+
+        handler->next = handler->next->next;
+        handler->mem_size = count;
+        fill_fences(heap, handler);
+        page_map_cover(heap, handler, handler);
+        heap->control_sum -= 6;
+        heap->headers_allocated--;
+        return USER_MEM_PTR(handler);
+    }
+
+    void *ptr = grow_backward(heap, handler, count, MEMORY_ALIGNMENT);
+    return ptr ? ptr : move_block(heap, handler, count, MEMORY_ALIGNMENT);
+}
+
+
+/* From [...cccfffUUUFFFcccfffUUUUFFF...] to [...cccfffUUUUUUUUUUUUUUUUFFF...] */
+static void free_block(Heap__ *heap, void* memblock) {
+    Slab__ *slab = slab_of(heap, memblock);
+    if (slab) {
+        slab_free(heap, slab, memblock);
+        return;
+    }
+
+    Header__ *handler = (Header__*)((uint8_t*)memblock - FENCE_LENGTH - CONTROL_STRUCT_SIZE);
+    if (is_outside_heap(heap, memblock)) {
+        large_free(heap, handler);
+        return;
+    }
+    page_map_cover(heap, handler, NULL);
+    handler->is_free = true;
+
+    Header__ *nxt = handler->next;
+    Header__ *prv = handler->prev;
+
+    if (prv && prv->is_free) handler = join_backward(heap, handler);
+    if (nxt && nxt->is_free) join_forward(heap, handler);
+    if (handler->next) {
+        handler->mem_size = calc_ptrs_distance(handler, handler->next) - HEADER_SIZE(0);
+    }
+    fill_fences(heap, handler);
+    bin_insert(heap, handler);
+    trim(heap, handler);
+}
+
+
+static void free_unlocked(Heap__ *heap, void* memblock) {
+    if (!heap || !memblock) return;
+    drain_remote_frees(heap);   //First, memblock may be queued already
+    if (pointer_type_unlocked(heap, memblock) != pointer_valid) return;
+    free_block(heap, memblock);
+}
+
+
+/*
+ * Frees of a thread finding the heap locked don't wait for it: the pointer goes in a free slot of the heap's queue,
+ * probed from a hash of the pointer, and whoever holds the lock next frees the queued blocks during a malloc or free.
+ * Neither the block nor the heap are read without the lock, pointers are checked once they are drained.
+ */
+static bool remote_free_push(Heap__ *heap, void *memblock) {
+    if (!HEAP_REMOTE_FREE || !heap || check_mode == heap_check_full) return false;
+    size_t start = (size_t)((uintptr_t)memblock / MEMORY_ALIGNMENT);
+    for (size_t i = 0; i < REMOTE_FREE_SLOTS; i++) {
+        void *_Atomic *slot = heap->remote_frees + (start + i) % REMOTE_FREE_SLOTS;
+        void *empty = NULL;
+        if (atomic_load_explicit(slot, memory_order_relaxed)) continue;
+        if (atomic_compare_exchange_strong_explicit(slot, &empty, memblock, memory_order_release, memory_order_relaxed)) {
+            atomic_fetch_add_explicit(&heap->remote_pending, 1, memory_order_release);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/* Queued pointers are classified like any free, a block queued twice is freed once and rejected the second time */
+static void drain_remote_frees(Heap__ *heap) {
+    if (!atomic_load_explicit(&heap->remote_pending, memory_order_relaxed)) return;
+    atomic_exchange_explicit(&heap->remote_pending, 0, memory_order_acquire);
+    for (size_t i = 0; i < REMOTE_FREE_SLOTS; i++) {
+        void *block = atomic_exchange_explicit(heap->remote_frees + i, NULL, memory_order_acquire);
+        if (block && classify_pointer(heap, block) == pointer_valid) free_block(heap, block);
+    }
+}
+
+
+/* Whether size could have been asked for the block, slab slots are rounded up to their class */
+static bool is_block_size(Heap__ *heap, void *memblock, size_t size) {
+    Slab__ *slab = slab_of(heap, memblock);
+    if (slab) return size && size <= slab->slot_size;
+    size_t mem_size = ((Header__*)((uint8_t*)memblock - FENCE_LENGTH - CONTROL_STRUCT_SIZE))->mem_size;
+    return size && size <= mem_size && mem_size <= ALIGN_UP(size);
+}
+
+
+/*
+ * Outside heap_check_full mode the size replaces the page map lookup: the pointer has to start a taken slab slot
+ * or a used block with an intact header, either of a size the caller could have asked for. Large blocks are looked up.
+ */
+static bool is_sized_block_start(Heap__ *heap, void *memblock, size_t size) {
+    if (is_outside_heap(heap, memblock)) return classify_pointer(heap, memblock) == pointer_valid && is_block_size(heap, memblock, size);
+    if (!heap->head || (intptr_t)memblock < (intptr_t)USER_MEM_PTR(heap->head)) return false;
+    Slab__ *slab = slab_of(heap, memblock);
+    if (slab) return slab_slot(slab, memblock) != slab->slots && is_block_size(heap, memblock, size);
+    Header__ *handler = (Header__*)((uint8_t*)memblock - FENCE_LENGTH - CONTROL_STRUCT_SIZE);
+    return !handler->is_free && is_header_control_sum_valid(handler) && are_header_fences_intact(handler) && is_block_size(heap, memblock, size);
+}
+
+
+static void free_sized_unlocked(Heap__ *heap, void* memblock, size_t size) {
+    if (!heap || !memblock) return;
+    drain_remote_frees(heap);
+    if (check_mode == heap_check_full) {
+        if (pointer_type_unlocked(heap, memblock) != pointer_valid) return;
+        if (HEAP_CHECK_FREE_SIZE && !is_block_size(heap, memblock, size)) return;
+    } else if (heap_check(heap) || !is_sized_block_start(heap, memblock, size)) {
+        return;
+    }
+    free_block(heap, memblock);
+}
+
+
+/* First address in the block's user memory at the alignment, far enough to leave a free block in front or none at all */
+static uint8_t* aligned_user_mem(Header__ *header, size_t alignment) {
+    uintptr_t user_mem = (uintptr_t)USER_MEM_PTR(header);
+    uintptr_t aligned = (user_mem + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    while (aligned != user_mem && aligned - user_mem < HEADER_SIZE(1)) aligned += alignment;
+    return (uint8_t*)aligned;
+}
+
+
+/* Free block at the end of the heap, grown to hold count bytes at the alignment, kept out of the bins */
+static Header__* free_tail(Heap__ *heap, size_t count, size_t alignment) {
+    Header__ *tail = last(heap);
+    Header__ *header = tail ? header_after(tail, tail->mem_size) : (Header__*)((uint8_t*)heap + heap->control_size);
+    if (tail && tail->is_free) header = tail;
+
+    uint8_t *heap_end = (uint8_t*)heap + heap->pages * MY_PAGE_SIZE;
+    uint8_t *needed_end = aligned_user_mem(header, alignment) + count + FENCE_LENGTH;
+    if (needed_end > heap_end) {
+        if (REQUEST_SPACE_FAIL == request_more_space(heap, (int)((needed_end - heap_end + MY_PAGE_SIZE - 1) / MY_PAGE_SIZE))) return NULL;
+        heap_end = (uint8_t*)heap + heap->pages * MY_PAGE_SIZE;
+    }
+
+    size_t mem_size = heap_end - FENCE_LENGTH - (uint8_t*)USER_MEM_PTR(header);
+    if (header == tail) {
+        bin_remove(heap, tail);
+        tail->mem_size = mem_size;
+        fill_fences(heap, tail);
+        return tail;
+    }
+    if (!tail) heap->head = header;
+    set_header(heap, header, mem_size, tail, NULL);
+    header->is_free = true;
+    update_header_control_sum(header);
+    return header;
+}
+
+
+/* Gives the aligned part of a free block its own header, the part in front stays in the bins as a free block */
+static Header__* split_in_front(Heap__ *heap, Header__ *header, uint8_t *user_mem) {
+    Header__ *aligned = (Header__*)(user_mem - FENCE_LENGTH - CONTROL_STRUCT_SIZE);
+    uint8_t *user_mem_end = (uint8_t*)USER_MEM_PTR(header) + header->mem_size;
+
+    set_header(heap, aligned, user_mem_end - user_mem, header, header->next);
+    header->mem_size = (uint8_t*)aligned - FENCE_LENGTH - (uint8_t*)USER_MEM_PTR(header);
+    fill_fences(heap, header);
+    bin_insert(heap, header);
+    return aligned;
+}
+
+
+/*
+ * Any power of two alignment. A free block with room for the alignment is taken from the bins, or the heap's
+ * last block is grown into one, then split into the gap in front, the aligned block and the rest behind it.
+ */
+static void* malloc_aligned_unlocked(Heap__ *heap, size_t count, size_t alignment) {
+    if (alignment <= MEMORY_ALIGNMENT) return malloc_unlocked(heap, count);
+    if (count < 1 || heap_check(heap) || count + alignment + HEADER_SIZE(1) < count) return NULL;
+    drain_remote_frees(heap);
+    if (alignment <= MY_PAGE_SIZE && is_large_size(heap, count)) {
+        void *ptr = large_malloc(heap, count, alignment);
+        if (ptr) return ptr;
+    }
+
+    Header__ *block = find_free_block(heap, count + alignment + HEADER_SIZE(1));
+    if (block) bin_remove(heap, block);
+    else if (!(block = free_tail(heap, count, alignment))) return NULL;
+
+    uint8_t *user_mem = aligned_user_mem(block, alignment);
+    if (user_mem != (uint8_t*)USER_MEM_PTR(block)) block = split_in_front(heap, block, user_mem);
+
+    if (block->mem_size > HEADER_SIZE(count) + MEMORY_ALIGNMENT) { //At least one byte for splittedheader's user mem, past the alignment
+        split_headers(heap, block, count);
+    } else {
+        //Set new size and put new right fences, lost memory will be reverted on heap_free()
+        block->mem_size = count;
+        block->is_free = false;
+        fill_fences(heap, block);
+    }
+    page_map_cover(heap, block, block);
+    return USER_MEM_PTR(block);
+}
+
+
+/* Blocks keep their address when resized in place, misaligned ones are moved to an aligned block */
+static void* realloc_aligned_unlocked(Heap__ *heap, void* memblock, size_t size, size_t alignment) {
+    if ((long long)size < 0 || (!memblock && !size) || heap_check(heap)) return NULL;
+    drain_remote_frees(heap);
+    if (!memblock) return malloc_aligned_unlocked(heap, size, alignment);
+    if (pointer_type_unlocked(heap, memblock) != pointer_valid) return NULL;
+    if (size == 0) return free_unlocked(heap, memblock), NULL;
+    Slab__ *slab = slab_of(heap, memblock);
+    if (slab) return slab_realloc(heap, slab, memblock, size, alignment);
+    Header__ *handler = (Header__*)((uint8_t*)memblock - FENCE_LENGTH - CONTROL_STRUCT_SIZE);
+    if (is_outside_heap(heap, memblock)) return large_realloc(heap, handler, size, alignment);
+    if (size > handler->mem_size && is_large_size(heap, size) && alignment <= MY_PAGE_SIZE) return move_block(heap, handler, size, alignment);
+
+    if ((uintptr_t)memblock & (alignment - 1)) {
+        return move_block(heap, handler, size, alignment);
+    } else if (size < handler->mem_size) {
+        shrink_block(heap, handler, size);
+        return USER_MEM_PTR(handler);
+    } else if (size == handler->mem_size) {
+        return USER_MEM_PTR(handler);
+    }
+
+    if (!handler->next) {
+        long long left_mem = calc_ptrs_distance((uint8_t *) USER_MEM_PTR(handler) + handler->mem_size,
+                                                (uint8_t *) heap + heap->pages * MY_PAGE_SIZE - FENCE_LENGTH);
+
+        if (left_mem < (long long) size) {
+            int pages_to_allocate = (int) ((long long) size - left_mem) / MY_PAGE_SIZE +
+                                    ((((long long) size - left_mem) / MY_PAGE_SIZE) % MY_PAGE_SIZE != 0);
+            pages_to_allocate = pages_to_allocate == 0 ? 1 : pages_to_allocate;
+            if (REQUEST_SPACE_FAIL == request_more_space(heap, pages_to_allocate)) return NULL;
+        }
+        handler->mem_size = size;
+        fill_fences(heap, handler);
+        page_map_cover(heap, handler, handler);
+        return USER_MEM_PTR(handler);
+
+    } else if (calc_ptrs_distance(USER_MEM_PTR(handler), handler->next) - FENCE_LENGTH > (long long)size) {
+        handler->mem_size = size;
+        fill_fences(heap, handler);
+        page_map_cover(heap, handler, handler);
+        return USER_MEM_PTR(handler);
+    } else if (handler->next->is_free && (uint8_t*)USER_MEM_PTR(header_after(handler, size)) < (uint8_t*)USER_MEM_PTR(handler->next) + handler->next->mem_size) {
+        Header__ *reduced = header_after(handler, size);
+        long long reduced_size = calc_ptrs_distance(USER_MEM_PTR(reduced), (uint8_t*)USER_MEM_PTR(handler->next) + handler->next->mem_size);
+        Header__ copy;
+
+        bin_remove(heap, handler->next);
+        page_map_cover(heap, handler, NULL);
+        forget_header(heap, handler->next);
+        memcpy(&copy, handler->next, sizeof(Header__));
+        reduced->next = copy.next;
+
+        if (copy.next) {
+            copy.next->prev = reduced;
+            update_header_control_sum(copy.next);
+        }
+
+        reduced->prev= handler;
+        reduced->mem_size = reduced_size;
+        reduced->is_free = true;
+        fill_fences(heap, reduced);
+        bin_insert(heap, reduced);
+
+        handler->next = reduced;
+        handler->mem_size = size;
+        fill_fences(heap, handler);
+        page_map_add(heap, reduced);
+        page_map_cover(heap, reduced, NULL);
+        page_map_cover(heap, handler, handler);
+        return USER_MEM_PTR(handler);
+    } else if (handler->next->is_free && calc_ptrs_distance(USER_MEM_PTR(handler), (uint8_t*)USER_MEM_PTR(handler->next) + handler->next->mem_size) > (long long)size) {
+        bin_remove(heap, handler->next);
+        forget_header(heap, handler->next);
+
+        if (handler->next->next) {
+            handler->next->next->prev = handler;
+            update_header_control_sum(handler->next->next);
+        }
+
+        handler->next = handler->next->next;
+        handler->mem_size = size;
+        fill_fences(heap, handler);
+        page_map_cover(heap, handler, handler);
+
+        heap->control_sum -= 6;
+        heap->headers_allocated--;
+        return USER_MEM_PTR(handler);
+    }
+
+    void *ptr = grow_backward(heap, handler, size, alignment);
+    return ptr ? ptr : move_block(heap, handler, size, alignment);
+}
+
+
+/*
+ * Batches check the heap once for all of their blocks. Blocks going through the regular path are cut one after
+ * another out of a single free region big enough for all of them, or out of the end of the heap grown at once.
+ */
+static size_t carve_blocks(Heap__ *heap, Header__ *region, size_t size, void **blocks, size_t count) {
+    size_t carved = 0;
+    for (;;) {
+        use_free_block(heap, region, size);
+        blocks[carved++] = USER_MEM_PTR(region);
+        if (carved == count || !region->next || !region->next->is_free || region->next->mem_size < size) return carved;
+        region = region->next;
+        bin_remove(heap, region);
+    }
+}
+
+
+static size_t malloc_batch_unlocked(Heap__ *heap, size_t size, void **blocks, size_t count) {
+    size_t done = 0;
+    if (size >= 1 && !heap_check(heap) && HEADER_SIZE(size) >= size) {
+        drain_remote_frees(heap);
+        size_t stride = ALIGN_UP(HEADER_SIZE(size));
+        //Slab slots and large blocks have allocators of their own
+        bool regular = !(size <= SLAB_MAX_SIZE && slabs_enabled()) && !is_large_size(heap, size) && count <= (SIZE_MAX - size) / stride;
+        while (regular && done < count) {
+            size_t needed = (count - done - 1) * stride + size;
+            Header__ *region = find_free_block(heap, needed);
+            if (region) bin_remove(heap, region);
+            else if (!(region = free_tail(heap, needed, MEMORY_ALIGNMENT))) break;
+            done += carve_blocks(heap, region, size, blocks + done, count - done);
+        }
+        while (done < count && (blocks[done] = malloc_unchecked(heap, size))) done++;
+    }
+    for (size_t i = done; i < count; i++) blocks[i] = NULL;
+    return done;
+}
+
+
+static void free_batch_unlocked(Heap__ *heap, void **blocks, size_t count) {
+    if (!heap || heap_check(heap) == HEAP_CORRUPTED) return;
+    drain_remote_frees(heap);
+    for (size_t i = 0; i < count; i++) {
+        if (blocks[i] && classify_pointer(heap, blocks[i]) == pointer_valid) free_block(heap, blocks[i]);
+    }
+}
+
+
+/*
+ * Handles of the default heap: numbered entries of a table in a custom_mmap() mapping, outside of the heap it compacts.
+ * Their blocks always have headers in the heap, and keep the handle in front of the caller's memory.
+ */
+static HandleEntry__ *handles = NULL;
+static size_t handles_capacity = 0;
+static size_t handles_count = 0;            /* Entries ever handed out */
+static uint32_t free_handles = 0;           /* First free entry's index + 1, the rest are chained through pins */
+
+
+static HandleEntry__* handle_entry(heap_handle_t handle) {
+    uint32_t index = (uint32_t)handle - 1;
+    if (index >= handles_count || !handles[index].block || handles[index].generation != (uint32_t)(handle >> 32)) return NULL;
+    return handles + index;
+}
+
+
+/* The entry of a block that compaction may move: a handle's block that is not pinned */
+static HandleEntry__* movable_entry(Heap__ *heap, Header__ *header) {
+    if (heap != main_heap || header->is_free || header->mem_size < HANDLE_PREFIX) return NULL;
+    heap_handle_t handle;
+    memcpy(&handle, USER_MEM_PTR(header), sizeof(handle));
+    HandleEntry__ *entry = handle_entry(handle);
+    return entry && entry->block == header && !entry->pins ? entry : NULL;
+}
+
+
+static bool reserve_handle(void) {
+    if (free_handles || handles_count < handles_capacity) return true;
+    size_t capacity = handles_capacity ? 2 * handles_capacity : MY_PAGE_SIZE / sizeof(HandleEntry__);
+    if (capacity > UINT32_MAX) return false;
+    void *table = handles ? custom_mremap(handles, handles_capacity * sizeof(HandleEntry__), capacity * sizeof(HandleEntry__), 1)
+                          : custom_mmap(capacity * sizeof(HandleEntry__));
+    if (table == (void*)-1) return false;
+    handles = table;
+    handles_capacity = capacity;
+    return true;
+}
+
+
+static heap_handle_t handle_alloc_unlocked(Heap__ *heap, size_t size) {
+    if (size < 1 || size > SIZE_MAX / 2 || heap_check(heap) || !reserve_handle()) return HEAP_HANDLE_NULL;
+    uint8_t *memblock = malloc_block(heap, size + HANDLE_PREFIX);
+    if (!memblock) return HEAP_HANDLE_NULL;
+
+    uint32_t index = free_handles ? free_handles - 1 : (uint32_t)handles_count++;
+    HandleEntry__ *entry = handles + index;
+    if (free_handles) free_handles = entry->pins;
+    entry->block = (Header__*)(memblock - FENCE_LENGTH - CONTROL_STRUCT_SIZE);
+    entry->pins = 0;
+    heap_handle_t handle = (uint64_t)entry->generation << 32 | (index + 1);
+    memcpy(memblock, &handle, sizeof(handle));
+    return handle;
+}
+
+
+static void handle_free_unlocked(Heap__ *heap, heap_handle_t handle) {
+    HandleEntry__ *entry = heap ? handle_entry(handle) : NULL;
+    if (!entry || heap_check(heap) == HEAP_CORRUPTED) return;
+    free_block(heap, USER_MEM_PTR(entry->block));
+    entry->block = NULL;
+    entry->generation++;
+    entry->pins = free_handles;
+    free_handles = (uint32_t)(entry - handles) + 1;
+}
+
+
+static void forget_handles(void) {
+    if (handles) custom_munmap(handles, handles_capacity * sizeof(HandleEntry__));
+    handles = NULL;
+    handles_capacity = handles_count = 0;
+    free_handles = 0;
+}
+
+
+/*
+ * From [cccfffFREEFFF|cccfffUUUFFF|...] to [cccfffUUUFFF|cccfffFREEFFF|...]
+ * Moves a block down into its free predecessor, the space it leaves joins a free successor. The last block moves too.
+ */
+static Header__* slide_block(Heap__ *heap, Header__ *handler) {
+    Header__ *nxt = handler->next;
+    uint8_t *end = !nxt ? (uint8_t*)USER_MEM_PTR(handler) + handler->mem_size
+                 : nxt->is_free ? (uint8_t*)USER_MEM_PTR(nxt) + nxt->mem_size : (uint8_t*)nxt - FENCE_LENGTH;
+    void *memblock = USER_MEM_PTR(handler);
+    size_t mem_size = handler->mem_size;
+
+    page_map_cover(heap, handler, NULL);
+    Header__ *block = join_backward(heap, handler);
+    if (nxt && nxt->is_free) join_forward(heap, block);
+    memmove(USER_MEM_PTR(block), memblock, mem_size);
+
+    block->mem_size = end - (uint8_t*)USER_MEM_PTR(block);
+    fill_fences(heap, block);
+    use_free_block(heap, block, mem_size);
+    return block;
+}
+
+
+/*
+ * Slides movable blocks down over the free blocks in front of them, so that free memory gathers behind pinned
+ * and plain blocks and at the end of the heap, which is trimmed once a pass gets there. The clock is read
+ * after every move and every COMPACT_CLOCK_STEPS blocks looked at, the next call resumes where this one stopped.
+ */
+#define COMPACT_CLOCK_STEPS 64
+
+static int compact_unlocked(Heap__ *heap, uint64_t budget_ns) {
+    int status = heap ? heap_check(heap) : HEAP_UNINITIALIZED;
+    if (status) return status;
+
+    uint64_t deadline = clock_ns() + budget_ns;
+    Header__ *iterator = heap->compact_cursor ? heap->compact_cursor : heap->head;
+    for (size_t steps = 1; iterator; steps++) {
+        HandleEntry__ *entry = iterator->is_free && iterator->next ? movable_entry(heap, iterator->next) : NULL;
+        if (entry) {
+            entry->block = slide_block(heap, iterator->next);
+            iterator = entry->block;
+        } else {
+            iterator = iterator->next;
+        }
+        if (iterator && (entry || steps % COMPACT_CLOCK_STEPS == 0) && clock_ns() >= deadline) {
+            heap->compact_cursor = iterator;
+            return HEAP_COMPACT_PENDING;
+        }
+    }
+    heap->compact_cursor = NULL;
+    if (heap->head) trim(heap, last(heap));
+    return 0;
+}
+
+
+/* Counters kept up to date by the bins, the large block list and fill_fences(), only the top bin is scanned */
+static int stats_unlocked(Heap__ *heap, heap_stats_t *stats) {
+    if (heap == NULL) return HEAP_UNINITIALIZED;
+    memset(stats, 0x0, sizeof(heap_stats_t));
+
+    size_t heap_bytes = heap->pages * MY_PAGE_SIZE;
+    size_t headers = heap->headers_allocated * HEADER_SIZE(0);
+    stats->reserved_bytes = heap_bytes + heap->large_mapped;
+    stats->free_bytes = heap->free_bytes;
+    stats->unused_bytes = (uint8_t*)heap + heap_bytes - heap->tail_end;
+    stats->overhead_bytes = heap->control_size + headers + heap->large_mapped - heap->large_bytes;
+    stats->used_bytes = stats->reserved_bytes - stats->free_bytes - stats->unused_bytes - stats->overhead_bytes;
+    stats->used_blocks = heap->headers_allocated - heap->free_blocks + heap->large_blocks;
+    stats->free_blocks = heap->free_blocks;
+    stats->large_blocks = heap->large_blocks;
+    stats->growths = heap->growths;
+    stats->grown_bytes = heap->grown_bytes;
+    memcpy(stats->free_blocks_by_class, heap->bin_counts, sizeof(stats->free_blocks_by_class));
+
+    //Blocks in the tree are bigger than any in the bins, its rightmost one is the largest
+    Header__ *largest = heap->free_tree;
+    while (largest && FREE_NODE(largest)->right) largest = FREE_NODE(largest)->right;
+    if (largest) {
+        stats->largest_free_block = largest->mem_size;
+    } else if (heap->bins_map) {
+        //Only the first blocks of the highest bin, the largest of them is at least half of any other in that bin
+        Header__ *iterator = heap->bins[63 - __builtin_clzll(heap->bins_map)];
+        for (unsigned seen = 0; iterator && seen < BIN_SCAN_LIMIT; iterator = iterator->next_free, seen++) {
+            if (iterator->mem_size > stats->largest_free_block) stats->largest_free_block = iterator->mem_size;
+        }
+    }
+    if (heap->free_blocks) stats->fragmentation = 1.0 - (double)stats->largest_free_block / (double)stats->free_bytes;
+    return 0;
+}
+
+
+static size_t largest_used_block_size_unlocked(Heap__ *heap) {
+
+    if (!heap || validate_unlocked(heap)) return 0;
+
+    size_t max = 0;
+    for (Header__ *iterator = heap->large; iterator; iterator = iterator->next) {
+        max = iterator->mem_size > max ? iterator->mem_size : max;
+    }
+    Header__ *iterator = heap->head;
+
+    while (iterator) {
+        if (!iterator->is_free) {
+            //A slab counts as its slot size while any of its slots is allocated outside the thread caches
+            Slab__ *slab = slab_of(heap, USER_MEM_PTR(iterator));
+            size_t size = slab ? (slab_allocated_slots(slab) ? slab->slot_size : 0) : iterator->mem_size;
+            max = size > max ? size : max;
+        }
+        iterator = iterator->next;
+    }
+    return max;
+}
 
-    intptr_t ptr_handler = (intptr_t)pointer;
 
-    if (ptr_handler < (intptr_t)heap) return pointer_unallocated;
-    if (ptr_handler < (intptr_t)((uint8_t*)heap + sizeof(Heap__))) return pointer_control_block;
+/* Memory the caller may use through a valid pointer, 0 for anything else */
+static size_t usable_size_unlocked(Heap__ *heap, const void *memblock) {
+    if (!heap || classify_pointer(heap, memblock) != pointer_valid) return 0;
+    if (is_outside_heap(heap, memblock)) return large_of(heap, memblock)->mem_size;
+    Slab__ *slab = slab_of(heap, memblock);
+    if (slab) return slab->slot_size;
+    return ((Header__*)((uint8_t*)memblock - FENCE_LENGTH - CONTROL_STRUCT_SIZE))->mem_size;
+}
 
-    Header__ *iterator = heap->head;
-    if (!heap->head) return pointer_unallocated;
-    while (iterator->next && (intptr_t)iterator->next <= ptr_handler) {
-        iterator = iterator->next;
-    }
 
+/* Where in the block of iterator the pointer falls */
+static enum pointer_type_t block_pointer_type(Header__ *iterator, const void* const pointer) {
+    intptr_t ptr_handler = (intptr_t)pointer;
     intptr_t control_block = (intptr_t)((uint8_t*)iterator + CONTROL_STRUCT_SIZE);
     intptr_t left_fences = (intptr_t)((uint8_t*) iterator + FENCE_LENGTH + CONTROL_STRUCT_SIZE);
-    intptr_t user_mem = (intptr_t)((uint8_t*)iterator->user_mem_ptr + iterator->mem_size);
-    intptr_t right_fences = (intptr_t)((uint8_t*)iterator->user_mem_ptr + iterator->mem_size + FENCE_LENGTH);
+    intptr_t user_mem = (intptr_t)((uint8_t*)USER_MEM_PTR(iterator) + iterator->mem_size);
+    intptr_t right_fences = (intptr_t)((uint8_t*)USER_MEM_PTR(iterator) + iterator->mem_size + FENCE_LENGTH);
 
     if (ptr_handler < control_block) return pointer_control_block;
     else if (ptr_handler < left_fences && !iterator->is_free) return pointer_inside_fences; // NOLINT(bugprone-branch-clone)
-    else if (ptr_handler == (intptr_t)iterator->user_mem_ptr && !iterator->is_free) return pointer_valid;
-    else if (ptr_handler == (intptr_t)iterator->user_mem_ptr) return pointer_unallocated;  // NOLINT(bugprone-branch-clone)
+    else if (ptr_handler == (intptr_t)USER_MEM_PTR(iterator) && !iterator->is_free) return pointer_valid;
+    else if (ptr_handler == (intptr_t)USER_MEM_PTR(iterator)) return pointer_unallocated;  // NOLINT(bugprone-branch-clone)
     else if (ptr_handler < user_mem && !iterator->is_free) return pointer_inside_data_block;
     else if (ptr_handler < user_mem) return pointer_unallocated;
     else if (ptr_handler < right_fences && !iterator->is_free) return pointer_inside_fences;
     return pointer_unallocated;
 }
+
+
+static enum pointer_type_t classify_pointer(Heap__ *heap, const void* const pointer) {
+    intptr_t ptr_handler = (intptr_t)pointer;
+
+    //Large blocks' mappings lie outside the heap, the gap in front of their headers is not allocated
+    if (is_outside_heap(heap, pointer)) {
+        Header__ *large = large_of(heap, pointer);
+        return large && ptr_handler >= (intptr_t)large ? block_pointer_type(large, pointer) : pointer_unallocated;
+    }
+    if (ptr_handler < (intptr_t)((uint8_t*)heap + heap->control_size)) return pointer_control_block;
+    if (!heap->head) return pointer_unallocated;
+
+    Slab__ *slab = slab_of(heap, pointer);
+    if (slab) return slab_pointer_type(slab, pointer);
+
+    Header__ *iterator = ptr_handler < (intptr_t)heap->head ? heap->head : page_map_lookup(heap, pointer);
+    if (!iterator) return pointer_unallocated;
+    return block_pointer_type(iterator, pointer);
+}
+
+
+static enum pointer_type_t pointer_type_unlocked(Heap__ *heap, const void* const pointer) {
+    if (!pointer) return pointer_null;
+    if (heap_check(heap) == HEAP_CORRUPTED) return pointer_heap_corrupted;
+    return classify_pointer(heap, pointer);
+}
+
+
+/*
+ * Per-thread cache of slab slots, one stack per TCACHE_CLASSES size class.
+ * Cached slots stay taken in their slab with their cached bit set, so popping and pushing them
+ * only touches the slab's atomic bitmap. Misses refill and overflows flush TCACHE_BATCH slots under one lock.
+ */
+struct thread_cache_t {
+    size_t generation;
+    bool registered;
+    unsigned counts[TCACHE_CLASSES];
+    void *blocks[TCACHE_CLASSES][TCACHE_CAPACITY];
+};
+
+static _Thread_local struct thread_cache_t tcache;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+
+static bool tcache_enabled() {
+    return HEAP_THREAD_CACHE && slabs_enabled();
+}
+
+
+static size_t tcache_class(size_t size) {
+    return size && size <= TCACHE_MAX_SIZE ? (size - 1) / BIN_GRANULARITY : TCACHE_CLASSES;
+}
+
+
+/* Sets or clears the cached bit of a slot entering or leaving a thread cache */
+static void tcache_mark(Heap__ *heap, void *memblock, bool cached) {
+    Slab__ *slab = slab_of(heap, memblock);
+    size_t slot = (size_t)((intptr_t)memblock - (intptr_t)slab - slab->first_slot) / slab->slot_size;
+    if (cached) atomic_fetch_or_explicit(slab->cached + slot / 64, 1ULL << slot % 64, memory_order_relaxed);
+    else atomic_fetch_and_explicit(slab->cached + slot / 64, ~(1ULL << slot % 64), memory_order_relaxed);
+}
+
+
+static void tcache_flush(struct thread_cache_t *cache, size_t class, unsigned count) {
+    pthread_mutex_lock(&heap_mutex);
+    if (cache->generation == atomic_load(&heap_generation)) {
+        for (unsigned i = 0; i < count; i++) {
+            void *block = cache->blocks[class][--cache->counts[class]];
+            tcache_mark(main_heap, block, false);
+            free_unlocked(main_heap, block);
+        }
+    }
+    pthread_mutex_unlock(&heap_mutex);
+}
+
+
+static void tcache_destroy(void *cache) {
+    for (size_t class = 0; class < TCACHE_CLASSES; class++) {
+        tcache_flush(cache, class, ((struct thread_cache_t*)cache)->counts[class]);
+    }
+}
+
+
+static void tcache_create_key() {
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+
+/* Brings the calling thread's cache in line with the current heap, returns false when there's no heap */
+static bool tcache_prepare() {
+    size_t generation = atomic_load(&heap_generation);
+    if (tcache.generation != generation) {
+        memset(tcache.counts, 0x0, sizeof(tcache.counts));
+        tcache.generation = generation;
+    }
+    if (!tcache.registered) {
+        pthread_once(&tcache_key_once, tcache_create_key);
+        tcache.registered = pthread_setspecific(tcache_key, &tcache) == 0;
+    }
+    return generation % 2 == 1;
+}
+
+
+static void* tcache_refill(size_t class) {
+    size_t block_size = (class + 1) * BIN_GRANULARITY;
+    pthread_mutex_lock(&heap_mutex);
+    void *block = malloc_unlocked(main_heap, block_size);
+    for (unsigned i = 1; block && i < TCACHE_BATCH && tcache.counts[class] < TCACHE_CAPACITY; i++) {
+        void *spare = malloc_unlocked(main_heap, block_size);
+        if (!spare) break;
+        if (!slab_of(main_heap, spare)) {   //Out of slabs, only slots are cached
+            free_unlocked(main_heap, spare);
+            break;
+        }
+        tcache_mark(main_heap, spare, true);
+        tcache.blocks[class][tcache.counts[class]++] = spare;
+    }
+    pthread_mutex_unlock(&heap_mutex);
+    return block;
+}
+
+
+/*
+ * Takes a slot of the class being freed into the calling thread's cache without the lock, TCACHE_CLASSES
+ * takes any class. Only the page map's slab entries and the slab bitmaps are shared, all of them atomic,
+ * and the cached bit set here makes a second free of the slot fall through to the locked path.
+ */
+static size_t tcache_claim(Heap__ *heap, void *memblock, size_t class) {
+    Slab__ *slab = slab_of(heap, memblock);
+    if (!slab || (class < TCACHE_CLASSES && slab->slot_size != (class + 1) * BIN_GRANULARITY)) return TCACHE_CLASSES;
+    size_t slot = slab_slot(slab, memblock);
+    uint64_t bit = 1ULL << slot % 64;
+    if (slot == slab->slots || atomic_fetch_or_explicit(slab->cached + slot / 64, bit, memory_order_relaxed) & bit) return TCACHE_CLASSES;
+    return slab->slot_size / BIN_GRANULARITY - 1;
+}
+
+
+static void tcache_push(size_t class, void *memblock) {
+    if (tcache.counts[class] == TCACHE_CAPACITY) tcache_flush(&tcache, class, TCACHE_BATCH);
+    tcache.blocks[class][tcache.counts[class]++] = memblock;
+}
+
+
+/*
+ * Binary trace of the default heap's calls. Records gather in a static buffer written out through unbuffered
+ * stdio once full, tracing never allocates after heap_trace_start(). Blocks are recorded before they are
+ * released and after they are obtained, so records of a block never go before its allocation.
+ */
+#if HEAP_TRACE
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool trace_enabled = false;
+static atomic_uint trace_threads = 0;
+static _Thread_local uint32_t trace_thread;
+static FILE *trace_file = NULL;
+static uint64_t trace_start;
+static size_t trace_count;
+static heap_trace_record_t trace_buffer[HEAP_TRACE_BUFFER];
+
+
+
+static void trace_flush(void) {
+    if (trace_count && fwrite(trace_buffer, sizeof(heap_trace_record_t), trace_count, trace_file) != trace_count) {
+        atomic_store(&trace_enabled, false);    //A trace with a hole in it can't be replayed
+    }
+    trace_count = 0;
+}
+
+
+/* Takes the trace lock when tracing, trace_append() and trace_end() may be called only after it returned true */
+static bool trace_begin(void) {
+    if (!atomic_load_explicit(&trace_enabled, memory_order_relaxed)) return false;
+    pthread_mutex_lock(&trace_mutex);
+    if (atomic_load(&trace_enabled)) return true;
+    pthread_mutex_unlock(&trace_mutex);
+    return false;
+}
+
+
+static void trace_append(heap_trace_op_t op, const void *block, const void *result, size_t size, size_t alignment) {
+    if (!trace_thread) trace_thread = atomic_fetch_add(&trace_threads, 1) + 1;
+    if (trace_count == HEAP_TRACE_BUFFER) trace_flush();
+    heap_trace_record_t *record = trace_buffer + trace_count++;
+    record->time = clock_ns() - trace_start;
+    record->block = (uintptr_t)block;
+    record->result = (uintptr_t)result;
+    record->size = size;
+    record->thread = trace_thread;
+    record->op = op;
+    record->alignment_shift = alignment ? __builtin_ctzll(alignment) : 0;
+}
+
+
+static void trace_end(void) {
+    pthread_mutex_unlock(&trace_mutex);
+}
+#else
+static bool trace_begin(void) {
+    return false;
+}
+
+
+static void trace_append(heap_trace_op_t op, const void *block, const void *result, size_t size, size_t alignment) {
+    (void)op, (void)block, (void)result, (void)size, (void)alignment;
+}
+
+
+static void trace_end(void) {
+}
+#endif
+
+
+static void trace_call(heap_trace_op_t op, const void *block, const void *result, size_t size, size_t alignment) {
+    if (trace_begin()) {
+        trace_append(op, block, result, size, alignment);
+        trace_end();
+    }
+}
+
+
+/* The thread cache first, the default heap when the size has no class or the cache is bypassed */
+static void* malloc_cached(size_t size) {
+    size_t class = tcache_class(size);
+    if (class < TCACHE_CLASSES && tcache_enabled() && tcache_prepare()) {
+        if (!tcache.counts[class]) return tcache_refill(class);
+        void *block = tcache.blocks[class][--tcache.counts[class]];
+        tcache_mark(atomic_load_explicit(&main_heap, memory_order_acquire), block, false);
+        return block;
+    }
+    pthread_mutex_lock(&heap_mutex);
+    void *ptr = malloc_unlocked(main_heap, size);
+    pthread_mutex_unlock(&heap_mutex);
+    return ptr;
+}
+
+
+/* A child forked while another thread held a lock would never see it released */
+static pthread_once_t fork_handlers_once = PTHREAD_ONCE_INIT;
+
+
+static void fork_prepare(void) {
+#if HEAP_TRACE
+    pthread_mutex_lock(&trace_mutex);
+#endif
+    pthread_mutex_lock(&heap_mutex);
+}
+
+
+static void fork_release(void) {
+    pthread_mutex_unlock(&heap_mutex);
+#if HEAP_TRACE
+    pthread_mutex_unlock(&trace_mutex);
+#endif
+}
+
+
+static void register_fork_handlers(void) {
+    pthread_atfork(fork_prepare, fork_release, fork_release);
+}
+
+
+static void clean_main_unlocked(void) {
+    if (main_heap) atomic_fetch_add(&heap_generation, 1);
+    forget_handles();
+    clean_unlocked(main_heap);
+    main_heap = NULL;
+}
+
+
+int heap_setup(void) {
+    pthread_once(&fork_handlers_once, register_fork_handlers);
+    pthread_mutex_lock(&heap_mutex);
+    clean_main_unlocked();      //A heap that was never cleaned is released with its handles and queued frees
+    Heap__ *heap = (Heap__*)custom_sbrk(MY_PAGE_SIZE);
+    if (heap != SBRK_FAIL) {
+        init_heap(heap, 0, main_page_map, HEAP_MAX_PAGES, sizeof(Heap__));
+        atomic_fetch_add(&heap_generation, 1);
+        main_heap = heap;
+    }
+    pthread_mutex_unlock(&heap_mutex);
+    return heap == SBRK_FAIL ? HEAP_INIT_FAIL : 0;
+}
+
+
+int heap_validate(void) {
+    pthread_mutex_lock(&heap_mutex);
+    int result = validate_unlocked(main_heap);
+    pthread_mutex_unlock(&heap_mutex);
+    return result;
+}
+
+
+void heap_clean(void) {
+    pthread_mutex_lock(&heap_mutex);
+    clean_main_unlocked();
+    pthread_mutex_unlock(&heap_mutex);
+}
+
+
+void* heap_malloc(size_t size) {
+    void *ptr = malloc_cached(size);
+    trace_call(heap_trace_malloc, NULL, ptr, size, 0);
+    return ptr;
+}
+
+
+void* heap_calloc(size_t number, size_t size) {
+    void *ptr;
+    //The thread cache recycles its blocks without looking at them, they are zeroed whole
+    if (size && number <= SIZE_MAX / size && tcache_class(number * size) < TCACHE_CLASSES && tcache_enabled()) {
+        ptr = malloc_cached(number * size);
+        if (ptr) memset(ptr, 0x0, number * size);
+    } else {
+        pthread_mutex_lock(&heap_mutex);
+        ptr = calloc_unlocked(main_heap, number, size, MEMORY_ALIGNMENT);
+        pthread_mutex_unlock(&heap_mutex);
+    }
+    trace_call(heap_trace_calloc, NULL, ptr, size && number > SIZE_MAX / size ? SIZE_MAX : number * size, 0);
+    return ptr;
+}
+
+
+void* heap_realloc(void* memblock, size_t count) {
+    pthread_mutex_lock(&heap_mutex);
+    void *ptr = realloc_unlocked(main_heap, memblock, count);
+    pthread_mutex_unlock(&heap_mutex);
+    trace_call(heap_trace_realloc, memblock, ptr, count, 0);
+    return ptr;
+}
+
+
+void heap_free(void* memblock) {
+    if (!memblock) return;
+    trace_call(heap_trace_free, memblock, NULL, 0, 0);
+    if (tcache_enabled() && tcache_prepare()) {
+        Heap__ *heap = atomic_load_explicit(&main_heap, memory_order_acquire);
+        size_t class = heap ? tcache_claim(heap, memblock, TCACHE_CLASSES) : TCACHE_CLASSES;
+        if (class < TCACHE_CLASSES) {
+            tcache_push(class, memblock);
+            return;
+        }
+    }
+    if (pthread_mutex_trylock(&heap_mutex)) {
+        if (remote_free_push(main_heap, memblock)) return;
+        pthread_mutex_lock(&heap_mutex);
+    }
+    free_unlocked(main_heap, memblock);
+    pthread_mutex_unlock(&heap_mutex);
+}
+
+
+void heap_free_sized(void* memblock, size_t size) {
+    if (!memblock) return;
+    trace_call(heap_trace_free, memblock, NULL, size, 0);
+    size_t class = tcache_class(size);
+    if (class < TCACHE_CLASSES && tcache_enabled() && tcache_prepare()) {
+        Heap__ *heap = atomic_load_explicit(&main_heap, memory_order_acquire);
+        if (heap && tcache_claim(heap, memblock, class) == class) {
+            tcache_push(class, memblock);
+            return;
+        }
+    }
+    if (pthread_mutex_trylock(&heap_mutex)) {
+        if (remote_free_push(main_heap, memblock)) return;
+        pthread_mutex_lock(&heap_mutex);
+    }
+    free_sized_unlocked(main_heap, memblock, size);
+    pthread_mutex_unlock(&heap_mutex);
+}
+
+
+size_t heap_malloc_batch(size_t size, void** blocks, size_t count) {
+    if (!blocks) return 0;
+    pthread_mutex_lock(&heap_mutex);
+    size_t done = malloc_batch_unlocked(main_heap, size, blocks, count);
+    pthread_mutex_unlock(&heap_mutex);
+    if (trace_begin()) {
+        for (size_t i = 0; i < done; i++) trace_append(heap_trace_malloc, NULL, blocks[i], size, 0);
+        trace_end();
+    }
+    return done;
+}
+
+
+void heap_free_batch(void** blocks, size_t count) {
+    if (!blocks) return;
+    if (trace_begin()) {
+        for (size_t i = 0; i < count; i++) {
+            if (blocks[i]) trace_append(heap_trace_free, blocks[i], NULL, 0, 0);
+        }
+        trace_end();
+    }
+    pthread_mutex_lock(&heap_mutex);
+    free_batch_unlocked(main_heap, blocks, count);
+    pthread_mutex_unlock(&heap_mutex);
+}
+
+
+void* heap_malloc_aligned(size_t count) {
+    pthread_mutex_lock(&heap_mutex);
+    void *ptr = malloc_aligned_unlocked(main_heap, count, MY_PAGE_SIZE);
+    pthread_mutex_unlock(&heap_mutex);
+    trace_call(heap_trace_malloc, NULL, ptr, count, MY_PAGE_SIZE);
+    return ptr;
+}
+
+
+void* heap_calloc_aligned(size_t number, size_t size) {
+    pthread_mutex_lock(&heap_mutex);
+    void *ptr = calloc_unlocked(main_heap, number, size, MY_PAGE_SIZE);
+    pthread_mutex_unlock(&heap_mutex);
+    trace_call(heap_trace_calloc, NULL, ptr, size && number > SIZE_MAX / size ? SIZE_MAX : number * size, MY_PAGE_SIZE);
+    return ptr;
+}
+
+
+void* heap_realloc_aligned(void* memblock, size_t size) {
+    pthread_mutex_lock(&heap_mutex);
+    void *ptr = realloc_aligned_unlocked(main_heap, memblock, size, MY_PAGE_SIZE);
+    pthread_mutex_unlock(&heap_mutex);
+    trace_call(heap_trace_realloc, memblock, ptr, size, MY_PAGE_SIZE);
+    return ptr;
+}
+
+
+static bool is_power_of_two(size_t value) {
+    return value && !(value & (value - 1));
+}
+
+
+void* heap_malloc_aligned_to(size_t count, size_t alignment) {
+    if (!is_power_of_two(alignment)) return NULL;
+    if (alignment <= MEMORY_ALIGNMENT) return heap_malloc(count);
+    pthread_mutex_lock(&heap_mutex);
+    void *ptr = malloc_aligned_unlocked(main_heap, count, alignment);
+    pthread_mutex_unlock(&heap_mutex);
+    trace_call(heap_trace_malloc, NULL, ptr, count, alignment);
+    return ptr;
+}
+
+
+void* heap_realloc_aligned_to(void* memblock, size_t count, size_t alignment) {
+    if (!is_power_of_two(alignment)) return NULL;
+    pthread_mutex_lock(&heap_mutex);
+    void *ptr = realloc_aligned_unlocked(main_heap, memblock, count, alignment < MEMORY_ALIGNMENT ? MEMORY_ALIGNMENT : alignment);
+    pthread_mutex_unlock(&heap_mutex);
+    trace_call(heap_trace_realloc, memblock, ptr, count, alignment);
+    return ptr;
+}
+
+
+size_t heap_get_largest_used_block_size(void) {
+    pthread_mutex_lock(&heap_mutex);
+    size_t max = largest_used_block_size_unlocked(main_heap);
+    pthread_mutex_unlock(&heap_mutex);
+    return max;
+}
+
+
+size_t heap_get_usable_size(const void* memblock) {
+    pthread_mutex_lock(&heap_mutex);
+    size_t size = usable_size_unlocked(main_heap, memblock);
+    pthread_mutex_unlock(&heap_mutex);
+    return size;
+}
+
+
+int heap_get_stats(heap_stats_t* stats) {
+    if (!stats) return HEAP_UNINITIALIZED;
+    pthread_mutex_lock(&heap_mutex);
+    int result = stats_unlocked(main_heap, stats);
+    pthread_mutex_unlock(&heap_mutex);
+    return result;
+}
+
+
+enum pointer_type_t get_pointer_type(const void* const pointer) {
+    pthread_mutex_lock(&heap_mutex);
+    enum pointer_type_t type = pointer_type_unlocked(main_heap, pointer);
+    pthread_mutex_unlock(&heap_mutex);
+    return type;
+}
+
+
+int heap_trace_start(const char* path) {
+#if HEAP_TRACE
+    if (!path) return HEAP_TRACE_FAIL;
+    pthread_mutex_lock(&trace_mutex);
+    FILE *file = trace_file ? NULL : fopen(path, "wb");
+    if (file && (setvbuf(file, NULL, _IONBF, 0) || fwrite(HEAP_TRACE_MAGIC, 1, 8, file) != 8)) {
+        fclose(file);
+        file = NULL;
+    }
+    if (file) {
+        trace_file = file;
+        trace_count = 0;
+        trace_start = clock_ns();
+        atomic_store(&trace_enabled, true);
+    }
+    pthread_mutex_unlock(&trace_mutex);
+    return file ? 0 : HEAP_TRACE_FAIL;
+#else
+    (void)path;
+    return HEAP_TRACE_FAIL;
+#endif
+}
+
+
+void heap_trace_stop(void) {
+#if HEAP_TRACE
+    pthread_mutex_lock(&trace_mutex);
+    if (trace_file) {
+        atomic_store(&trace_enabled, false);
+        trace_flush();
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+    pthread_mutex_unlock(&trace_mutex);
+#endif
+}
+
+
+heap_handle_t heap_handle_alloc(size_t size) {
+    pthread_mutex_lock(&heap_mutex);
+    heap_handle_t handle = handle_alloc_unlocked(main_heap, size);
+    pthread_mutex_unlock(&heap_mutex);
+    return handle;
+}
+
+
+void heap_handle_free(heap_handle_t handle) {
+    pthread_mutex_lock(&heap_mutex);
+    handle_free_unlocked(main_heap, handle);
+    pthread_mutex_unlock(&heap_mutex);
+}
+
+
+void* heap_handle_pin(heap_handle_t handle) {
+    pthread_mutex_lock(&heap_mutex);
+    HandleEntry__ *entry = main_heap ? handle_entry(handle) : NULL;
+    if (entry) entry->pins++;
+    void *ptr = entry ? (uint8_t*)USER_MEM_PTR(entry->block) + HANDLE_PREFIX : NULL;
+    pthread_mutex_unlock(&heap_mutex);
+    return ptr;
+}
+
+
+void heap_handle_unpin(heap_handle_t handle) {
+    pthread_mutex_lock(&heap_mutex);
+    HandleEntry__ *entry = main_heap ? handle_entry(handle) : NULL;
+    if (entry && entry->pins) entry->pins--;
+    pthread_mutex_unlock(&heap_mutex);
+}
+
+
+int heap_compact(uint64_t budget_ns) {
+    pthread_mutex_lock(&heap_mutex);
+    int status = compact_unlocked(main_heap, budget_ns);
+    pthread_mutex_unlock(&heap_mutex);
+    return status;
+}
+
+
+/*
+ * Arenas are independent heaps placed in their own custom_mmap() mapping. The whole capacity is reserved
+ * at creation and committed page by page, so destroying an arena releases all of its blocks in one call.
+ */
+heap_arena_t* heap_arena_create(size_t capacity) {
+    if (capacity < 1 || capacity > SIZE_MAX - 2 * MY_PAGE_SIZE) return NULL;
+    //The control struct and a page map entry for every page of the mapping go in front of the blocks
+    size_t control_pages = 1;
+    size_t pages = (capacity + MY_PAGE_SIZE - 1) / MY_PAGE_SIZE;
+    while (ALIGN_UP(sizeof(Heap__) + (pages + control_pages) * sizeof(PageEntry__)) > control_pages * MY_PAGE_SIZE) control_pages++;
+    pages += control_pages;
+
+    Heap__ *arena = (Heap__*)custom_mmap(pages * MY_PAGE_SIZE);
+    if (arena == SBRK_FAIL) return NULL;
+
+    init_heap(arena, pages, (PageEntry__*)(arena + 1), pages, sizeof(Heap__) + pages * sizeof(PageEntry__));
+    if (pthread_mutex_init(&arena->mutex, NULL) != 0) {
+        custom_munmap(arena, pages * MY_PAGE_SIZE);
+        return NULL;
+    }
+    return arena;
+}
+
+
+void heap_arena_destroy(heap_arena_t* arena) {
+    if (!arena) return;
+    size_t pages = arena->max_pages;
+    pthread_mutex_destroy(&arena->mutex);
+    custom_munmap(arena, pages * MY_PAGE_SIZE);
+}
+
+
+int heap_arena_validate(heap_arena_t* arena) {
+    if (!arena) return HEAP_UNINITIALIZED;
+    pthread_mutex_lock(&arena->mutex);
+    int result = validate_unlocked(arena);
+    pthread_mutex_unlock(&arena->mutex);
+    return result;
+}
+
+
+void* heap_arena_malloc(heap_arena_t* arena, size_t size) {
+    if (!arena) return NULL;
+    pthread_mutex_lock(&arena->mutex);
+    void *ptr = malloc_unlocked(arena, size);
+    pthread_mutex_unlock(&arena->mutex);
+    return ptr;
+}
+
+
+void* heap_arena_calloc(heap_arena_t* arena, size_t number, size_t size) {
+    if (!arena) return NULL;
+    pthread_mutex_lock(&arena->mutex);
+    void *ptr = calloc_unlocked(arena, number, size, MEMORY_ALIGNMENT);
+    pthread_mutex_unlock(&arena->mutex);
+    return ptr;
+}
+
+
+void* heap_arena_realloc(heap_arena_t* arena, void* memblock, size_t count) {
+    if (!arena) return NULL;
+    pthread_mutex_lock(&arena->mutex);
+    void *ptr = realloc_unlocked(arena, memblock, count);
+    pthread_mutex_unlock(&arena->mutex);
+    return ptr;
+}
+
+
+void heap_arena_free(heap_arena_t* arena, void* memblock) {
+    if (!arena || !memblock) return;
+    if (pthread_mutex_trylock(&arena->mutex)) {
+        if (remote_free_push(arena, memblock)) return;
+        pthread_mutex_lock(&arena->mutex);
+    }
+    free_unlocked(arena, memblock);
+    pthread_mutex_unlock(&arena->mutex);
+}
+
+
+enum pointer_type_t heap_arena_get_pointer_type(heap_arena_t* arena, const void* pointer) {
+    if (!arena) return pointer_null;
+    pthread_mutex_lock(&arena->mutex);
+    enum pointer_type_t type = pointer_type_unlocked(arena, pointer);
+    pthread_mutex_unlock(&arena->mutex);
+    return type;
+}
+
+
+int heap_arena_get_stats(heap_arena_t* arena, heap_stats_t* stats) {
+    if (!arena || !stats) return HEAP_UNINITIALIZED;
+    pthread_mutex_lock(&arena->mutex);
+    int result = stats_unlocked(arena, stats);
+    pthread_mutex_unlock(&arena->mutex);
+    return result;
+}
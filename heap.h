@@ -2,46 +2,274 @@
 #define HEAP_H
 
 #include <stdlib.h>                 /* For size_t, could be replaced with <stddef.h>, <stdio.h>, <string.h>, <time.h>, <wchar.h> */
+#include <stddef.h>                 /* For offsetof() */
 #include <stdbool.h>                /* For bool type */
 #include <string.h>                 /* For memcpy() */
 #include <stdio.h>                  /* For logging with printf funcs */
 #include <inttypes.h>               /* For uintptr_t */
+#include <pthread.h>                /* For heap lock and thread cache destructor */
+#include <stdatomic.h>              /* For heap generation shared with thread caches */
 #include "custom_unistd.h"          /* For (custom_)sbrk function, required for project */
 #include "display_dependencies.h"   /* For colourful terminal messages */
 
 
 #define FENCE_LENGTH 0x3
 #define MY_PAGE_SIZE 0x1000
-#define CONTROL_STRUCT_SIZE sizeof(Header__)
+#define CONTROL_STRUCT_SIZE offsetof(Header__, left_fence)
 #define HEADER_SIZE(size) (CONTROL_STRUCT_SIZE + (size) + 2 * FENCE_LENGTH)
+#define USER_MEM_PTR(header) ((void*)((uint8_t*)(header) + CONTROL_STRUCT_SIZE + FENCE_LENGTH))
+#define MEMORY_ALIGNMENT 0x10        /* Of every header and user pointer */
+#define ALIGN_UP(size) (((size) + MEMORY_ALIGNMENT - 1) & ~(size_t)(MEMORY_ALIGNMENT - 1))
 
 #define SBRK_FAIL (void*)(-1)
 #define HEAP_INIT_FAIL (-1)
 #define REQUEST_SPACE_FAIL HEAP_INIT_FAIL
+#define HEAP_TRACE_FAIL HEAP_INIT_FAIL
 
 #define HEAP_CORRUPTED 1
 #define HEAP_UNINITIALIZED 2
 #define HEAP_CONTROL_STRUCT_BLUR 3
+#define HEAP_COMPACT_PENDING 4      /* heap_compact() ran out of time before reaching the end of the heap */
 
+#define HEAP_HANDLE_NULL 0
+#define HANDLE_PREFIX MEMORY_ALIGNMENT /* In front of a handle's memory, holds the handle so compaction can find its entry */
+
+#define HEAP_CHECKSUM_BYTES 0        /* Sum of header bytes */
+#define HEAP_CHECKSUM_WORDS 1        /* Rotating sum of 64-bit header words */
+#define HEAP_CHECKSUM_CRC32C 2       /* CRC32C, hardware instruction when built with SSE4.2 or ARMv8 CRC */
+#ifndef HEAP_CHECKSUM
+#define HEAP_CHECKSUM HEAP_CHECKSUM_WORDS
+#endif
+#if HEAP_CHECKSUM == HEAP_CHECKSUM_CRC32C && defined(__SSE4_2__)
+#include <nmmintrin.h>              /* For _mm_crc32_u64() */
+#elif HEAP_CHECKSUM == HEAP_CHECKSUM_CRC32C && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>               /* For __crc32cd() */
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>              /* For _mm_stream_si128() */
+#endif
+
+#ifndef HEAP_CHECK_MODE
+#define HEAP_CHECK_MODE heap_check_full
+#endif
+#ifndef HEAP_CHECK_PARAMETER
+#define HEAP_CHECK_PARAMETER 64     /* Every Nth call when sampled, headers per call when incremental */
+#endif
+
+#ifndef HEAP_CHECK_FREE_SIZE
+#define HEAP_CHECK_FREE_SIZE 1      /* heap_free_sized() compares the size with the block's in heap_check_full mode */
+#endif
+
+#ifndef HEAP_THREAD_CACHE
+#define HEAP_THREAD_CACHE 1         /* Per-thread cache of small blocks, bypassed in heap_check_full mode */
+#endif
+#define TCACHE_CLASSES 16
+#define TCACHE_MAX_SIZE (TCACHE_CLASSES * BIN_GRANULARITY)
+#define TCACHE_CAPACITY 32
+#define TCACHE_BATCH 8
+
+#ifndef HEAP_REMOTE_FREE
+#define HEAP_REMOTE_FREE 1          /* Frees finding the heap locked queue the block for the lock holder, bypassed in heap_check_full mode */
+#endif
+#define REMOTE_FREE_SLOTS 64        /* Frees a locked heap can queue, more wait for the lock */
+
+#ifndef HEAP_SLABS
+#define HEAP_SLABS 1                /* Header-less slab pages for small blocks, bypassed in heap_check_full mode */
+#endif
+#define SLAB_CLASSES 16
+#define SLAB_MAX_SIZE (SLAB_CLASSES * BIN_GRANULARITY)
+#define SLAB_BITMAP_WORDS (MY_PAGE_SIZE / BIN_GRANULARITY / 64)
+
+#ifndef HEAP_STREAM_ZERO_SIZE
+#define HEAP_STREAM_ZERO_SIZE 0x40000 /* Calloc zeroes this many bytes and more with non-temporal stores, past the cache */
+#endif
+
+#ifndef HEAP_MMAP_THRESHOLD
+#define HEAP_MMAP_THRESHOLD 0x20000 /* Blocks from this size up get their own custom_mmap() mapping, 0 disables it */
+#endif
+
+#ifndef HEAP_TRIM_THRESHOLD
+#define HEAP_TRIM_THRESHOLD 0x20000 /* Free memory at the end of the heap from which the break is moved back, 0 disables it */
+#endif
+
+#ifndef HEAP_TRIM_PAD
+#define HEAP_TRIM_PAD 0x10000       /* Free memory left at the end of the heap when trimming */
+#endif
+
+#ifndef HEAP_GROWTH_PERCENT
+#define HEAP_GROWTH_PERCENT 25      /* The break grows by this part of the heap's size at once, between the two below */
+#endif
+#ifndef HEAP_GROWTH_MIN
+#define HEAP_GROWTH_MIN 0x10000
+#endif
+#ifndef HEAP_GROWTH_MAX
+#define HEAP_GROWTH_MAX 0x400000
+#endif
+
+#ifndef HEAP_TRACE
+#define HEAP_TRACE 1                /* heap_trace_start() records calls to a file, a relaxed load per call while stopped */
+#endif
+#ifndef HEAP_TRACE_BUFFER
+#define HEAP_TRACE_BUFFER 4096      /* Trace records gathered in memory before they are written out */
+#endif
+#define HEAP_TRACE_MAGIC "HEAPTRC1" /* First 8 bytes of a trace file, records follow */
+
+#ifndef HEAP_MAX_PAGES
+#define HEAP_MAX_PAGES 16384        /* Size of the default heap's page map, 64 MiB of sbrk memory */
+#endif
+
+#define BINS_COUNT 64
+#define SMALL_BINS_COUNT 16
+#define BIN_GRANULARITY 0x10
+#define SMALL_BINS_LIMIT (SMALL_BINS_COUNT * BIN_GRANULARITY)
+#define BIN_SCAN_LIMIT 8            /* Blocks of the request's own bin looked at before a larger bin is taken */
+
+#ifndef HEAP_FREE_TREE
+#define HEAP_FREE_TREE 1            /* Free blocks from HEAP_FREE_TREE_MIN bytes up are placed best-fit through a size tree */
+#endif
+#ifndef HEAP_FREE_TREE_MIN
+#define HEAP_FREE_TREE_MIN 0x400    /* Smaller free blocks stay in the bins */
+#endif
+
+/* Naturally aligned, the left fence fills the header up to a multiple of MEMORY_ALIGNMENT and user memory follows it */
 struct header_t {
     struct header_t *prev;
     struct header_t *next;
     size_t mem_size;
-    short is_free;
-    void *user_mem_ptr;
-    long long control_sum;
-} __attribute__((packed));
+    struct header_t *prev_free;
+    struct header_t *next_free;
+    uint32_t control_sum;           /* Covers the fields above and is_free */
+    uint8_t is_free;
+    uint8_t left_fence[FENCE_LENGTH];
+};
 
 typedef struct header_t Header__;
 
+/* AVL tree links of a free block ordered by size then address, kept in its user memory while it is free */
+struct free_node_t {
+    struct header_t *left;
+    struct header_t *right;
+    size_t height;
+};
+
+typedef struct free_node_t FreeNode__;
+
+_Static_assert(HEAP_FREE_TREE_MIN >= sizeof(FreeNode__), "free blocks in the tree must hold their links");
+
+_Static_assert((offsetof(Header__, left_fence) + FENCE_LENGTH) % MEMORY_ALIGNMENT == 0, "user memory must follow the header aligned");
+
+/* Descriptor at the start of a slab page, slots follow it at first_slot */
+struct slab_t {
+    struct slab_t *prev_partial;    /* Slabs of the same class with free slots */
+    struct slab_t *next_partial;
+    uint16_t slot_size;
+    uint16_t slots;
+    uint16_t used;
+    uint16_t first_slot;
+    _Atomic uint64_t taken[SLAB_BITMAP_WORDS];  /* Bit n set when slot n is allocated, bits past the last slot stay set */
+    _Atomic uint64_t cached[SLAB_BITMAP_WORDS]; /* Bit n set while allocated slot n sits in a thread cache */
+};
+
+typedef struct slab_t Slab__;
+
+struct page_entry_t {
+    Header__ *first;                /* First header starting in the page */
+    Header__ *cover;                /* Used block spanning the page, valid only when first is NULL */
+    Slab__ *_Atomic slab;           /* Set when the page is a slab, read without the lock by the thread cache */
+};
+
+typedef struct page_entry_t PageEntry__;
+
+/* Entry of the default heap's handle table */
+struct handle_entry_t {
+    Header__ *block;                /* NULL while the entry is free */
+    uint32_t pins;                  /* The block stays in place while pinned, chains free entries by index + 1 */
+    uint32_t generation;            /* Bumped when the handle is freed, so that stale handles are refused */
+};
+
+typedef struct handle_entry_t HandleEntry__;
+
 struct heap_t {
     size_t control_sum;
     size_t pages;
+    size_t max_pages;               /* 0 when growing through custom_sbrk, otherwise size of the arena's mapping */
+    size_t control_size;            /* Bytes taken by this struct and the page map in front of the first block */
+    PageEntry__ *page_map;
+    size_t page_map_length;
     size_t headers_allocated;
     Header__ *head;
-} __attribute__((packed));
+    Header__ *large;                /* Blocks mapped on their own, linked through prev and next */
+    size_t large_blocks;
+    size_t large_bytes;             /* User memory of the large blocks */
+    size_t large_mapped;            /* Length of their mappings */
+    uint8_t *clean;                 /* Memory from here to the end of the heap was never written since it was requested */
+    uint8_t *tail_end;              /* Right past the last block's right fence */
+    Header__ *bins[BINS_COUNT];     /* Free blocks only, segregated by size class */
+    Header__ *free_tree;            /* Free blocks of HEAP_FREE_TREE_MIN bytes and more instead of their bins */
+    uint64_t bins_map;              /* Bit n set when bins[n] is not empty */
+    size_t bin_counts[BINS_COUNT];
+    size_t free_blocks;
+    size_t free_bytes;              /* User memory of the blocks in the bins and the tree */
+    size_t growths;                 /* Times the heap asked for more pages */
+    size_t grown_bytes;
+    Slab__ *slabs[SLAB_CLASSES];    /* Slabs with free slots, by slot size class */
+    size_t check_calls;
+    Header__ *check_cursor;         /* Next header to be verified by incremental checking */
+    Header__ *compact_cursor;       /* Header the next heap_compact() call resumes from */
+    void *_Atomic remote_frees[REMOTE_FREE_SLOTS];  /* Blocks freed while the heap was locked, NULL in free slots */
+    atomic_size_t remote_pending;   /* Blocks queued since the last drain, the slots aren't scanned while it's 0 */
+    pthread_mutex_t mutex;          /* Arenas only, the default heap is guarded by a static mutex */
+};
 
 typedef struct heap_t Heap__;
+typedef struct heap_t heap_arena_t;
+
+typedef enum heap_check_mode_t {
+    heap_check_off,
+    heap_check_sampled,
+    heap_check_incremental,
+    heap_check_full
+} heap_check_mode_t;
+
+typedef struct heap_stats_t {
+    size_t reserved_bytes;          /* Heap pages and large blocks' mappings, the sum of the four below */
+    size_t used_bytes;              /* Held by used blocks, alignment slack and free slab slots included */
+    size_t free_bytes;              /* User memory of free blocks */
+    size_t unused_bytes;            /* End of the heap past the last block */
+    size_t overhead_bytes;          /* Control structures, headers, fences and large blocks' padding */
+    size_t used_blocks;
+    size_t free_blocks;
+    size_t large_blocks;
+    size_t largest_free_block;      /* Exact from the tree, from the bins at least half of the largest free block */
+    size_t free_blocks_by_class[BINS_COUNT];
+    size_t growths;
+    size_t grown_bytes;
+    double fragmentation;           /* 1 - largest_free_block / free_bytes, 0 without free blocks */
+} heap_stats_t;
+
+/* Index of the handle table entry + 1 in the low half, the entry's generation in the high half */
+typedef uint64_t heap_handle_t;
+
+typedef enum heap_trace_op_t {
+    heap_trace_malloc,
+    heap_trace_calloc,
+    heap_trace_realloc,
+    heap_trace_free
+} heap_trace_op_t;
+
+/* One call to the default heap, stored as is in trace files */
+typedef struct heap_trace_record_t {
+    uint64_t time;                  /* Nanoseconds since heap_trace_start() */
+    uint64_t block;                 /* Passed to realloc and free */
+    uint64_t result;                /* Returned by malloc, calloc and realloc */
+    uint64_t size;                  /* Requested size, number * size for calloc */
+    uint32_t thread;                /* Numbered from 1 in order of the threads' first traced call */
+    uint16_t op;                    /* heap_trace_op_t */
+    uint16_t alignment_shift;       /* Requested alignment as a power of two, 0 when not aligned */
+} heap_trace_record_t;
+
+_Static_assert(sizeof(heap_trace_record_t) == 40, "trace records are written without padding");
 
 typedef enum pointer_type_t {
     pointer_null,
@@ -57,17 +285,47 @@ typedef enum pointer_type_t {
 int heap_setup(void);
 int heap_validate(void);
 void heap_clean(void);
+void heap_set_check_mode(heap_check_mode_t mode, size_t parameter);
+void heap_set_mmap_threshold(size_t threshold);
+void heap_set_trim_threshold(size_t threshold, size_t pad);
+void heap_set_growth_policy(size_t min_chunk, size_t max_chunk, unsigned percent);
 
 void* heap_malloc(size_t size);
 void* heap_calloc(size_t number, size_t size);
 void* heap_realloc(void* memblock, size_t count);
 void heap_free(void* memblock);
+void heap_free_sized(void* memblock, size_t size);
+size_t heap_malloc_batch(size_t size, void** blocks, size_t count);
+void heap_free_batch(void** blocks, size_t count);
 
 void* heap_malloc_aligned(size_t count);
 void* heap_calloc_aligned(size_t number, size_t size);
 void* heap_realloc_aligned(void* memblock, size_t size);
+void* heap_malloc_aligned_to(size_t count, size_t alignment);
+void* heap_realloc_aligned_to(void* memblock, size_t count, size_t alignment);
 
 size_t heap_get_largest_used_block_size(void);
+size_t heap_get_usable_size(const void* memblock);
+int heap_get_stats(heap_stats_t* stats);
 enum pointer_type_t get_pointer_type(const void* pointer);
 
+int heap_trace_start(const char* path);
+void heap_trace_stop(void);
+
+heap_handle_t heap_handle_alloc(size_t size);
+void heap_handle_free(heap_handle_t handle);
+void* heap_handle_pin(heap_handle_t handle);
+void heap_handle_unpin(heap_handle_t handle);
+int heap_compact(uint64_t budget_ns);
+
+heap_arena_t* heap_arena_create(size_t capacity);
+void heap_arena_destroy(heap_arena_t* arena);
+int heap_arena_validate(heap_arena_t* arena);
+void* heap_arena_malloc(heap_arena_t* arena, size_t size);
+void* heap_arena_calloc(heap_arena_t* arena, size_t number, size_t size);
+void* heap_arena_realloc(heap_arena_t* arena, void* memblock, size_t count);
+void heap_arena_free(heap_arena_t* arena, void* memblock);
+enum pointer_type_t heap_arena_get_pointer_type(heap_arena_t* arena, const void* pointer);
+int heap_arena_get_stats(heap_arena_t* arena, heap_stats_t* stats);
+
 #endif
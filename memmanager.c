@@ -4,6 +4,11 @@
  * Autor: Tomasz Jaworski, 2020
  *
  * Wersja   Opis
+ * 1.06     Tryb szybki (MEMORY_FAST_SBRK): atomowe przesuwanie brk, płotki sprawdzane okresowo i na żądanie
+ * 1.05     Strony przydzielane i zwalniane przez custom_sbrk() są zerowane
+ * 1.04     Emulacja mremap() dla mapowań stronicowych
+ * 1.03     Poprawka zakleszczenia w memory_check()
+ * 1.02     Emulacja mmap()/munmap() dla mapowań stronicowych
  * 1.01     Dodanie dodatkowego płotka brk + zewnętrzna walidacja płotków
  * 1.00     Init
  */
@@ -16,6 +21,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
 #if !defined(__clang__) && !defined(__GNUC__)
 // Zakomentuj poniższy błąd, jeżeli chcesz przetestować testy na swoim kompilatorze C.
@@ -37,6 +43,23 @@
 // Makro zaokrągla adres bajta __addr do adresu bazowego następnej strony
 #define ROUND_TO_NEXT_PAGE(__addr) (((__addr) & ~(PAGE_SIZE - 1)) + PAGE_SIZE * !!((__addr) & (PAGE_SIZE - 1)))
 
+/*
+ * Tryb szybki (-DMEMORY_FAST_SBRK=1) dla pomiarów wydajności. custom_sbrk() przesuwa brk w górę jedną operacją atomową,
+ * bez muteksu, bez sprawdzania płotków i bez kopiowania płotka brk. Pamięć za brk jest zawsze wyzerowana
+ * i to zera pełnią rolę płotka brk. Płotki są sprawdzane co FENCE_CHECK_PERIOD wywołań custom_sbrk()
+ * oraz przez custom_sbrk_check_fences_integrity(). Domyślny tryb ścisły sprawdza płotki przy każdym wywołaniu.
+ */
+#ifndef MEMORY_FAST_SBRK
+#define MEMORY_FAST_SBRK 0
+#endif
+#define FENCE_CHECK_PERIOD 256
+
+// Słowo stanu brk: przesunięcie brk względem start_brk, wersja granicy mapowań i blokada na czas jej zmiany
+#define BRK_OFFSET_MASK 0xFFFFFFFFull
+#define BRK_VERSION_MASK 0x7FFFFFFF00000000ull
+#define BRK_VERSION_ONE 0x100000000ull
+#define BRK_LOCKED      0x8000000000000000ull
+
 
 uint8_t memory[PAGE_SIZE * PAGES_TOTAL] __attribute__((aligned(PAGE_SIZE)));
 
@@ -47,15 +70,57 @@ struct memory_fence_t {
 
 struct mm_struct {
     intptr_t start_brk;
-    intptr_t brk;
+    _Atomic uint64_t brk_state;         // Zamiast brk, zob. BRK_OFFSET_MASK; adres brk zwraca memory_brk()
 
     pthread_mutex_t mutex;
 
     // Poniższe pola nie należą do standardowej struktury mm_struct
     struct memory_fence_t fence;
     intptr_t start_mmap;
+
+    _Atomic intptr_t mmap_base;         // Najniższa strona zajęta przez mapowania (start_mmap, gdy ich brak)
+    uint8_t mmap_used[PAGES_AVAILABLE]; // 1 - strona należy do mapowania
+    uint64_t mmap_pages;
+    atomic_uint sbrk_calls;
 } mm;
 
+static const uint8_t zero_page[PAGE_SIZE];
+
+
+static intptr_t memory_brk(void)
+{
+    return mm.start_brk + (intptr_t)(atomic_load(&mm.brk_state) & BRK_OFFSET_MASK);
+}
+
+// Wstrzymuje szybkie custom_sbrk() na czas zmiany granicy mapowań lub sprawdzania płotków, wywoływana z zajętym muteksem
+static void brk_lock(void)
+{
+    uint64_t state = atomic_load(&mm.brk_state);
+    while (!atomic_compare_exchange_weak(&mm.brk_state, &state, state | BRK_LOCKED))
+        ;
+}
+
+// Nowa wersja unieważnia granicę mapowań odczytaną przez szybkie custom_sbrk() przed blokadą
+static void brk_unlock(void)
+{
+    uint64_t state = atomic_load(&mm.brk_state);
+    atomic_store(&mm.brk_state, (state & BRK_OFFSET_MASK) | ((state + BRK_VERSION_ONE) & BRK_VERSION_MASK));
+}
+
+// Przesuwa brk, wywoływana z zajętym muteksem w trybie ścisłym lub z zablokowanym brk
+static void brk_set(intptr_t brk)
+{
+    uint64_t state = atomic_load(&mm.brk_state);
+    atomic_store(&mm.brk_state, (state & ~BRK_OFFSET_MASK) | (uint64_t)(brk - mm.start_brk));
+}
+
+// Czy brk może stanąć w end, razem z płotkiem za nim
+static int brk_fits(intptr_t end)
+{
+    intptr_t mmap_base = atomic_load(&mm.mmap_base);
+    return end < mm.start_mmap && (mmap_base == mm.start_mmap || ROUND_TO_NEXT_PAGE(end) + PAGE_SIZE <= mmap_base);
+}
+
 
 void __attribute__((constructor)) memory_init(void)
 {
@@ -101,8 +166,9 @@ void __attribute__((constructor)) memory_init(void)
     //
     // Inicjuj strukturę opisującą pamięć procesu (symulację tej struktury)
     mm.start_brk = (intptr_t)(memory + PAGE_SIZE);
-    mm.brk = (intptr_t)(memory + PAGE_SIZE);
+    atomic_init(&mm.brk_state, 0);
     mm.start_mmap = (intptr_t)(memory + (PAGE_FENCE + PAGES_AVAILABLE) * PAGE_SIZE);
+    atomic_init(&mm.mmap_base, mm.start_mmap);
 
     assert(mm.start_mmap - mm.start_brk == PAGES_AVAILABLE * PAGE_SIZE);
 
@@ -110,7 +176,8 @@ void __attribute__((constructor)) memory_init(void)
     // Ustaw płotki
     memcpy(memory, mm.fence.first_page, PAGE_SIZE); // płotek przed pierwszą stroną CAŁEJ przestrzeni
     memcpy((void*)mm.start_mmap, mm.fence.last_page, PAGE_SIZE); // płotek za ostatnią stroną CAŁEJ przestrzeni
-    memcpy((void*)mm.brk, mm.fence.last_page, PAGE_SIZE); // płotek za ostatnią stroną PRZYDZIELONEGO obszaru sterty
+    if (!MEMORY_FAST_SBRK)
+        memcpy((void*)memory_brk(), mm.fence.last_page, PAGE_SIZE); // płotek za ostatnią stroną PRZYDZIELONEGO obszaru sterty
 
 
     //
@@ -127,8 +194,11 @@ static void memory_validate_fences(int* ok_first, int* ok_brk, int* ok_last) {
     if (ok_first != NULL) // Sprawdź płotek PRZED stertą alokatora
         *ok_first = memcmp(memory, mm.fence.first_page, PAGE_SIZE) == 0;
 
-    if (ok_brk != NULL) // Sprawdź płotek ruchomy (w pozycji brk)
-        *ok_brk = memcmp((const void *)ROUND_TO_NEXT_PAGE(mm.brk), mm.fence.last_page, PAGE_SIZE) == 0;
+    if (ok_brk != NULL) { // Sprawdź płotek ruchomy (w pozycji brk); w trybie szybkim są nim zera, chyba że to już płotek końca
+        intptr_t fence = ROUND_TO_NEXT_PAGE(memory_brk());
+        const uint8_t *pattern = MEMORY_FAST_SBRK && fence != mm.start_mmap ? zero_page : mm.fence.last_page;
+        *ok_brk = memcmp((const void *)fence, pattern, PAGE_SIZE) == 0;
+    }
 
     if (ok_last != NULL) // Sprawdź płotek PO stercie alokatora
         *ok_last = memcmp((const void *) mm.start_mmap, mm.fence.last_page, PAGE_SIZE) == 0;
@@ -137,6 +207,7 @@ static void memory_validate_fences(int* ok_first, int* ok_brk, int* ok_last) {
 void __attribute__((destructor)) memory_check(void)
 {
     pthread_mutex_lock(&mm.mutex);
+    brk_lock();
 
     //
     // Sprawdź płotki
@@ -150,11 +221,12 @@ void __attribute__((destructor)) memory_check(void)
 
     printf("### Podsumowanie: \n");
     printf("    Całkowita przestrzeni dostępnej pamięci: %lu bajtów\n", mm.start_mmap - mm.start_brk);
-    printf("    Pamięć zarezerwowana przez sbrk() .....: %llu bajtów\n", custom_sbrk_get_reserved_memory());
+    printf("    Pamięć zarezerwowana przez sbrk() .....: %llu bajtów\n", (unsigned long long)(memory_brk() - mm.start_brk)); // Muteks jest już zajęty
 
     printf("Naciśnij ENTER...");
     fgetc(stdin);
 
+    brk_unlock();
     pthread_mutex_unlock(&mm.mutex);
     pthread_mutex_destroy(&mm.mutex);
 }
@@ -165,6 +237,7 @@ void __attribute__((destructor)) memory_check(void)
 
 int custom_sbrk_check_fences_integrity(void) {
     pthread_mutex_lock(&mm.mutex);
+    brk_lock();
 
     int ok_first, ok_brk, ok_last;
     memory_validate_fences(&ok_first, &ok_brk, &ok_last);
@@ -180,56 +253,222 @@ int custom_sbrk_check_fences_integrity(void) {
      * 0x07 - wszystkie płotki padły.
      * itd...
     */
+    brk_unlock();
     pthread_mutex_unlock(&mm.mutex);
     return status; //
 }
 
 uint64_t custom_sbrk_get_reserved_memory(void) {
 
-    pthread_mutex_lock(&mm.mutex);
-    uint64_t return_value = mm.brk - mm.start_brk;
-    pthread_mutex_unlock(&mm.mutex);
+    return memory_brk() - mm.start_brk;
+}
 
-    return return_value;
+// Szybkie przesunięcie brk w górę; pamięć za brk jest już wyzerowana
+static void* fast_sbrk_grow(intptr_t delta)
+{
+    uint64_t state = atomic_load(&mm.brk_state);
+    for (;;) {
+        if (state & BRK_LOCKED) {
+            // Blokadę trzyma wątek z zajętym muteksem, zwolni ją przed jego zwolnieniem
+            pthread_mutex_lock(&mm.mutex);
+            pthread_mutex_unlock(&mm.mutex);
+            state = atomic_load(&mm.brk_state);
+            continue;
+        }
+
+        intptr_t current_brk = mm.start_brk + (intptr_t)(state & BRK_OFFSET_MASK);
+        if (!brk_fits(current_brk + delta)) {
+            errno = ENOMEM;
+            return (void*)-1;
+        }
+        uint64_t moved = (state & ~BRK_OFFSET_MASK) | (uint64_t)(current_brk + delta - mm.start_brk);
+        if (atomic_compare_exchange_weak(&mm.brk_state, &state, moved))
+            return (void*)current_brk;
+    }
 }
 
 void* custom_sbrk(intptr_t delta)
 {
     int ok_first, ok_brk, ok_last;
-    memory_validate_fences(&ok_first, &ok_brk, &ok_last);
+    if (MEMORY_FAST_SBRK && atomic_fetch_add(&mm.sbrk_calls, 1) % FENCE_CHECK_PERIOD != 0) {
+        ok_first = ok_brk = ok_last = 1;
+    } else if (MEMORY_FAST_SBRK) {
+        ok_first = !custom_sbrk_check_fences_integrity();
+        ok_brk = ok_last = ok_first;
+    } else {
+        memory_validate_fences(&ok_first, &ok_brk, &ok_last);
+    }
     if (!ok_first || !ok_brk || !ok_last) {
         printf("-----------------------------------------------\n");
         printf("<strong style=\"color:red;\">custom_sbrk:</strong> Wykryto uszkodzenie płotków sterty");
         exit(-1);
     }
 
+    if (MEMORY_FAST_SBRK && delta >= 0)
+        return fast_sbrk_grow(delta);
+
     pthread_mutex_lock(&mm.mutex);
+    if (MEMORY_FAST_SBRK)
+        brk_lock();
     void* return_value;
 
-    intptr_t current_brk = mm.brk;
-    if (mm.brk + delta < mm.start_brk) {
+    intptr_t current_brk = memory_brk();
+    if (current_brk + delta < mm.start_brk) {
         errno = 0;
         return_value = (void*)current_brk;
         goto _exit; // :P
     }
 
-    if (mm.brk + delta >= mm.start_mmap) {
+    if (!brk_fits(current_brk + delta)) {
         errno = ENOMEM;
         return_value = (void*)-1;
         goto _exit;
     }
 
+    // Strony dołączane do sterty i z niej zwracane są wyzerowane, tak jak w jądrze (razem ze starym płotkiem brk)
+    if (MEMORY_FAST_SBRK)
+        memset((void*)(current_brk + delta), 0, -delta); // Za brk są już same zera
+    else if (delta > 0)
+        memset((void*)current_brk, 0, delta);
+    else
+        memset((void*)(current_brk + delta), 0, ROUND_TO_NEXT_PAGE(current_brk) + PAGE_SIZE - (current_brk + delta));
+
     // Przesuń
-    mm.brk += delta;
+    brk_set(current_brk + delta);
     return_value = (void*)current_brk;
 
     // płotek za ostatnią stroną PRZYDZIELONEGO obszaru sterty
-    memcpy((void*)ROUND_TO_NEXT_PAGE(mm.brk), mm.fence.last_page, PAGE_SIZE);
+    if (!MEMORY_FAST_SBRK)
+        memcpy((void*)ROUND_TO_NEXT_PAGE(memory_brk()), mm.fence.last_page, PAGE_SIZE);
 
     //
     //
 
     _exit:;
+    if (MEMORY_FAST_SBRK)
+        brk_unlock();
     pthread_mutex_unlock(&mm.mutex);
     return return_value;
 }
+
+//
+//
+//
+
+// Przydziela od góry ciągły obszar wolnych stron, wywoływana z zajętym muteksem
+static void* mmap_take_pages(size_t pages)
+{
+    intptr_t lowest_free = ROUND_TO_NEXT_PAGE(memory_brk()) + PAGE_SIZE; // Pierwsza strona za płotkiem brk
+
+    size_t run = 0;
+    for (intptr_t page = PAGES_AVAILABLE - 1; page >= 0; page--) {
+        intptr_t address = mm.start_brk + page * PAGE_SIZE;
+        if (address < lowest_free)
+            break;
+
+        run = mm.mmap_used[page] ? 0 : run + 1;
+        if (run == pages) {
+            memset(mm.mmap_used + page, 1, pages);
+            mm.mmap_pages += pages;
+            if (address < mm.mmap_base)
+                mm.mmap_base = address;
+            return (void*)address;
+        }
+    }
+    return (void*)-1;
+}
+
+// Zwalnia strony [first, first + pages), wywoływana z zajętym muteksem
+static void mmap_release_pages(size_t first, size_t pages)
+{
+    for (size_t page = first; page < first + pages; page++) {
+        if (mm.mmap_used[page]) {
+            mm.mmap_used[page] = 0;
+            mm.mmap_pages--;
+            memset((void*)(mm.start_brk + page * PAGE_SIZE), 0, PAGE_SIZE); // Zwolnione strony wracają do "systemu" wyzerowane
+        }
+    }
+
+    // Przesuń granicę mapowań do najniższej wciąż zajętej strony
+    while (mm.mmap_base < mm.start_mmap && !mm.mmap_used[(mm.mmap_base - mm.start_brk) / PAGE_SIZE])
+        mm.mmap_base += PAGE_SIZE;
+}
+
+void* custom_mmap(size_t length)
+{
+    if (length == 0)
+        return (void*)-1;
+
+    pthread_mutex_lock(&mm.mutex);
+    brk_lock();
+    void* return_value = mmap_take_pages(ROUND_TO_NEXT_PAGE(length) / PAGE_SIZE);
+    if (return_value == (void*)-1)
+        errno = ENOMEM;
+    brk_unlock();
+    pthread_mutex_unlock(&mm.mutex);
+    return return_value;
+}
+
+int custom_munmap(void* addr, size_t length)
+{
+    intptr_t address = (intptr_t)addr;
+    if (length == 0 || (address & (PAGE_SIZE - 1)) || address < mm.start_brk || address + (intptr_t)length > mm.start_mmap) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&mm.mutex);
+    brk_lock();
+    mmap_release_pages((address - mm.start_brk) / PAGE_SIZE, ROUND_TO_NEXT_PAGE(length) / PAGE_SIZE);
+    brk_unlock();
+    pthread_mutex_unlock(&mm.mutex);
+    return 0;
+}
+
+void* custom_mremap(void* old_address, size_t old_length, size_t new_length, int may_move)
+{
+    intptr_t address = (intptr_t)old_address;
+    if (old_length == 0 || new_length == 0 || (address & (PAGE_SIZE - 1)) || address < mm.start_brk || address + (intptr_t)old_length > mm.start_mmap) {
+        errno = EINVAL;
+        return (void*)-1;
+    }
+
+    pthread_mutex_lock(&mm.mutex);
+    brk_lock();
+    size_t first = (address - mm.start_brk) / PAGE_SIZE;
+    size_t old_pages = ROUND_TO_NEXT_PAGE(old_length) / PAGE_SIZE;
+    size_t new_pages = ROUND_TO_NEXT_PAGE(new_length) / PAGE_SIZE;
+    void* return_value = old_address;
+
+    // Strony bezpośrednio za mapowaniem, które są wolne
+    size_t free_after = 0;
+    while (old_pages + free_after < new_pages && first + old_pages + free_after < PAGES_AVAILABLE && !mm.mmap_used[first + old_pages + free_after])
+        free_after++;
+
+    if (new_pages <= old_pages) {
+        mmap_release_pages(first + new_pages, old_pages - new_pages);
+    } else if (old_pages + free_after == new_pages) {
+        memset(mm.mmap_used + first + old_pages, 1, free_after);
+        mm.mmap_pages += free_after;
+    } else if (!may_move || (return_value = mmap_take_pages(new_pages)) == (void*)-1) {
+        return_value = (void*)-1;
+        errno = ENOMEM;
+    } else {
+        // Jądro przepina strony bez kopiowania, emulacja musi przenieść ich zawartość
+        memcpy(return_value, old_address, old_pages * PAGE_SIZE);
+        mmap_release_pages(first, old_pages);
+    }
+
+    brk_unlock();
+    pthread_mutex_unlock(&mm.mutex);
+    return return_value;
+}
+
+uint64_t custom_mmap_get_reserved_memory(void) {
+
+    pthread_mutex_lock(&mm.mutex);
+    uint64_t return_value = mm.mmap_pages * PAGE_SIZE;
+    pthread_mutex_unlock(&mm.mutex);
+
+    return return_value;
+}
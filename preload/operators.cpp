@@ -0,0 +1,65 @@
+/*
+ * C++ allocation operators of libheap.so. Blocks come from the library's own malloc() and aligned_alloc(),
+ * so they are set up on first use like any other, sized deletes hand their size over to heap_free_sized().
+ */
+#include <cstdlib>
+#include <new>
+
+#define EXPORT __attribute__((visibility("default")))
+
+extern "C" void heap_free_sized(void* memblock, std::size_t size);
+
+
+static void* allocate(std::size_t size, std::size_t alignment) {
+    size = size ? size : 1;
+    for (;;) {
+        void *ptr = alignment ? std::aligned_alloc(alignment, size) : std::malloc(size);
+        if (ptr) return ptr;
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) throw std::bad_alloc();
+        handler();
+    }
+}
+
+
+static void* try_allocate(std::size_t size, std::size_t alignment) noexcept {
+    try {
+        return allocate(size, alignment);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+
+static void release_sized(void* ptr, std::size_t size) noexcept {
+    if (ptr) heap_free_sized(ptr, size ? size : 1);
+}
+
+
+EXPORT void* operator new(std::size_t size) { return allocate(size, 0); }
+EXPORT void* operator new[](std::size_t size) { return allocate(size, 0); }
+EXPORT void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return try_allocate(size, 0); }
+EXPORT void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return try_allocate(size, 0); }
+
+EXPORT void* operator new(std::size_t size, std::align_val_t alignment) { return allocate(size, static_cast<std::size_t>(alignment)); }
+EXPORT void* operator new[](std::size_t size, std::align_val_t alignment) { return allocate(size, static_cast<std::size_t>(alignment)); }
+EXPORT void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return try_allocate(size, static_cast<std::size_t>(alignment));
+}
+EXPORT void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return try_allocate(size, static_cast<std::size_t>(alignment));
+}
+
+EXPORT void operator delete(void* ptr) noexcept { std::free(ptr); }
+EXPORT void operator delete[](void* ptr) noexcept { std::free(ptr); }
+EXPORT void operator delete(void* ptr, const std::nothrow_t&) noexcept { std::free(ptr); }
+EXPORT void operator delete[](void* ptr, const std::nothrow_t&) noexcept { std::free(ptr); }
+EXPORT void operator delete(void* ptr, std::size_t size) noexcept { release_sized(ptr, size); }
+EXPORT void operator delete[](void* ptr, std::size_t size) noexcept { release_sized(ptr, size); }
+
+EXPORT void operator delete(void* ptr, std::align_val_t) noexcept { std::free(ptr); }
+EXPORT void operator delete[](void* ptr, std::align_val_t) noexcept { std::free(ptr); }
+EXPORT void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { std::free(ptr); }
+EXPORT void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { std::free(ptr); }
+EXPORT void operator delete(void* ptr, std::size_t size, std::align_val_t) noexcept { release_sized(ptr, size); }
+EXPORT void operator delete[](void* ptr, std::size_t size, std::align_val_t) noexcept { release_sized(ptr, size); }
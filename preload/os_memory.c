@@ -0,0 +1,97 @@
+/*
+ * custom_unistd.h backed by the operating system, replaces memmanager.c in the preload library.
+ * The break moves inside OS_BRK_RESERVE bytes of address space reserved inaccessible on the first call,
+ * pages are made accessible as it grows and handed back as it shrinks, so they read as zeros when it grows again.
+ * Mappings are plain anonymous mmap() ones.
+ */
+#define _GNU_SOURCE                 /* For mremap() and MAP_NORESERVE */
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include "../custom_unistd.h"
+
+#ifndef OS_BRK_RESERVE
+#define OS_BRK_RESERVE 0x100000000ull   /* 4 GiB, the heap's HEAP_MAX_PAGES has to cover it */
+#endif
+#define OS_PAGE_SIZE 0x1000
+#define OS_PAGE_UP(address) (((uintptr_t)(address) + OS_PAGE_SIZE - 1) & ~(uintptr_t)(OS_PAGE_SIZE - 1))
+
+static pthread_mutex_t brk_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t *brk_start = NULL;
+static uint8_t *brk_current = NULL;
+static uint8_t *brk_committed = NULL;  /* Pages from brk_start up to here are accessible */
+static atomic_uint_fast64_t mmap_reserved = 0;
+
+
+void* custom_sbrk(intptr_t delta) {
+    pthread_mutex_lock(&brk_mutex);
+    if (!brk_start) {
+        void *reserve = mmap(NULL, OS_BRK_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (reserve != MAP_FAILED) brk_start = brk_current = brk_committed = reserve;
+    }
+
+    uint8_t *previous = brk_current;
+    uint8_t *end = brk_current + delta;
+    if (!brk_start || (delta > 0 && (uintptr_t)delta > OS_BRK_RESERVE - (uintptr_t)(brk_current - brk_start))
+        || (delta < 0 && (uintptr_t)-delta > (uintptr_t)(brk_current - brk_start))) {
+        previous = (void*)-1;
+    } else if (end > brk_committed) {
+        if (mprotect(brk_committed, OS_PAGE_UP(end) - (uintptr_t)brk_committed, PROT_READ | PROT_WRITE)) previous = (void*)-1;
+        else brk_committed = (uint8_t*)OS_PAGE_UP(end);
+    } else if (delta < 0) {
+        //The part of the last page left behind the break is zeroed like the pages handed back
+        uint8_t *kept = (uint8_t*)OS_PAGE_UP(end);
+        memset(end, 0x0, kept - end);
+        if (kept < brk_committed) {
+            madvise(kept, brk_committed - kept, MADV_DONTNEED);
+            mprotect(kept, brk_committed - kept, PROT_NONE);
+            brk_committed = kept;
+        }
+    }
+    if (previous != (void*)-1) brk_current = end;
+    pthread_mutex_unlock(&brk_mutex);
+    return previous;
+}
+
+
+int custom_sbrk_check_fences_integrity(void) {
+    return 0;   //Memory past the break is inaccessible, writes there fault instead of damaging a fence
+}
+
+
+uint64_t custom_sbrk_get_reserved_memory(void) {
+    pthread_mutex_lock(&brk_mutex);
+    uint64_t reserved = brk_current - brk_start;
+    pthread_mutex_unlock(&brk_mutex);
+    return reserved;
+}
+
+
+void* custom_mmap(size_t length) {
+    void *mapping = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) return (void*)-1;
+    atomic_fetch_add(&mmap_reserved, OS_PAGE_UP(length));
+    return mapping;
+}
+
+
+int custom_munmap(void* addr, size_t length) {
+    if (munmap(addr, length)) return -1;
+    atomic_fetch_sub(&mmap_reserved, OS_PAGE_UP(length));
+    return 0;
+}
+
+
+void* custom_mremap(void* old_address, size_t old_length, size_t new_length, int may_move) {
+    void *mapping = mremap(old_address, old_length, new_length, may_move ? MREMAP_MAYMOVE : 0);
+    if (mapping == MAP_FAILED) return (void*)-1;
+    atomic_fetch_add(&mmap_reserved, OS_PAGE_UP(new_length));
+    atomic_fetch_sub(&mmap_reserved, OS_PAGE_UP(old_length));
+    return mapping;
+}
+
+
+uint64_t custom_mmap_get_reserved_memory(void) {
+    return atomic_load(&mmap_reserved);
+}
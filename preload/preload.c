@@ -0,0 +1,120 @@
+/*
+ * C library allocation functions on top of the default heap, built into libheap.so by `make preload_lib`
+ * and loaded in front of the C library with LD_PRELOAD=./libheap.so. The heap is set up on the first call.
+ * HEAP_TRACE_FILE in the environment traces the whole run to that file.
+ */
+#include <errno.h>
+#include "../heap.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+static pthread_once_t setup_once = PTHREAD_ONCE_INIT;
+static atomic_bool ready = false;
+
+
+static void setup(void) {
+    heap_setup();
+    atomic_store(&ready, true);
+}
+
+
+static void lazy_setup(void) {
+    if (!atomic_load_explicit(&ready, memory_order_acquire)) pthread_once(&setup_once, setup);
+}
+
+
+/* The C library's allocation functions never fail on size 0, a one byte block stands in for it */
+static size_t at_least_one(size_t size) {
+    return size ? size : 1;
+}
+
+
+EXPORT void* malloc(size_t size) {
+    lazy_setup();
+    void *ptr = heap_malloc(at_least_one(size));
+    if (!ptr) errno = ENOMEM;
+    return ptr;
+}
+
+
+EXPORT void free(void* ptr) {
+    if (ptr) heap_free(ptr);
+}
+
+
+EXPORT void* calloc(size_t number, size_t size) {
+    lazy_setup();
+    void *ptr = number && size ? heap_calloc(number, size) : heap_calloc(1, 1);
+    if (!ptr) errno = ENOMEM;
+    return ptr;
+}
+
+
+EXPORT void* realloc(void* ptr, size_t size) {
+    lazy_setup();
+    if (ptr && !size) {
+        heap_free(ptr);
+        return NULL;
+    }
+    void *moved = heap_realloc(ptr, at_least_one(size));
+    if (!moved) errno = ENOMEM;
+    return moved;
+}
+
+
+EXPORT int posix_memalign(void** memptr, size_t alignment, size_t size) {
+    if (!alignment || alignment % sizeof(void*) || alignment & (alignment - 1)) return EINVAL;
+    lazy_setup();
+    void *ptr = heap_malloc_aligned_to(at_least_one(size), alignment);
+    if (!ptr) return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+
+EXPORT void* aligned_alloc(size_t alignment, size_t size) {
+    lazy_setup();
+    void *ptr = heap_malloc_aligned_to(at_least_one(size), alignment);
+    if (!ptr) errno = alignment && !(alignment & (alignment - 1)) ? ENOMEM : EINVAL;
+    return ptr;
+}
+
+
+/* Obsolete, still called by older code, the C library's own would hand out blocks free() can't take back */
+EXPORT void* memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
+
+
+EXPORT void* valloc(size_t size) {
+    return aligned_alloc(MY_PAGE_SIZE, size);
+}
+
+
+EXPORT void* pvalloc(size_t size) {
+    return aligned_alloc(MY_PAGE_SIZE, (at_least_one(size) + MY_PAGE_SIZE - 1) & ~(size_t)(MY_PAGE_SIZE - 1));
+}
+
+
+EXPORT size_t malloc_usable_size(void* ptr) {
+    return ptr ? heap_get_usable_size(ptr) : 0;
+}
+
+
+/* A %p in the path is replaced with the process id, so that programs it runs don't overwrite its trace */
+__attribute__((constructor)) static void start_trace(void) {
+    static char path[4096];
+    const char *pattern = getenv("HEAP_TRACE_FILE");
+    lazy_setup();
+    if (!pattern) return;
+
+    const char *pid = strstr(pattern, "%p");
+    int length = pid ? snprintf(path, sizeof(path), "%.*s%ld%s", (int)(pid - pattern), pattern, (long)getpid(), pid + 2)
+                     : snprintf(path, sizeof(path), "%s", pattern);
+    if (length > 0 && (size_t)length < sizeof(path)) heap_trace_start(path);
+}
+
+
+__attribute__((destructor)) static void stop_trace(void) {
+    heap_trace_stop();
+}
@@ -0,0 +1,45 @@
+/*
+ * A free block that fits deep in its bin behind blocks that are too small, built and run by `make test`.
+ * With no larger block free, it has to be found before the heap grows.
+ */
+#include <assert.h>
+#include "../heap.c"
+
+#define SMALL_SIZE 520
+#define FIT_SIZE 900
+#define REQUEST_SIZE 700
+#define SMALL_BLOCKS (BIN_SCAN_LIMIT * 3)
+#define SEPARATOR_SIZE 64
+
+
+int main(void) {
+    void *separators[SMALL_BLOCKS + 1], *small[SMALL_BLOCKS];
+    assert(heap_setup() == 0);
+    assert(bin_index(SMALL_SIZE) == bin_index(FIT_SIZE) && bin_index(FIT_SIZE) == bin_index(REQUEST_SIZE));
+
+    //Used blocks between the free ones keep them from joining
+    void *fit = heap_malloc(FIT_SIZE);
+    separators[0] = heap_malloc(SEPARATOR_SIZE);
+    for (size_t i = 0; i < SMALL_BLOCKS; i++) {
+        small[i] = heap_malloc(SMALL_SIZE);
+        separators[i + 1] = heap_malloc(SEPARATOR_SIZE);
+        assert(small[i] && separators[i + 1]);
+    }
+
+    //Bins take freed blocks at their front, the fitting one ends up last
+    heap_free(fit);
+    for (size_t i = 0; i < SMALL_BLOCKS; i++) heap_free(small[i]);
+    heap_stats_t before, after;
+    assert(heap_get_stats(&before) == 0);
+    uint64_t reserved = custom_sbrk_get_reserved_memory();
+
+    assert(heap_malloc(REQUEST_SIZE) == fit);
+    assert(heap_get_stats(&after) == 0);
+    assert(custom_sbrk_get_reserved_memory() == reserved);
+    assert(after.unused_bytes == before.unused_bytes);
+    assert(heap_validate() == 0);
+
+    heap_clean();
+    printf("find fit ok\n");
+    return 0;
+}
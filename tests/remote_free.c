@@ -0,0 +1,142 @@
+/*
+ * Frees racing with a thread holding the heap lock, built and run by `make test`.
+ * heap.c is included to hold heap_mutex directly, so every free of the test runs into a locked heap.
+ */
+#define _POSIX_C_SOURCE 200809L     /* For nanosleep() */
+#include <assert.h>
+#include <time.h>
+#include "../heap.c"
+
+#define BLOCK_SIZE 600
+
+typedef struct free_job_t {
+    heap_arena_t *arena;            /* NULL for the default heap */
+    void *blocks[REMOTE_FREE_SLOTS + 4];
+    size_t count;
+    atomic_bool started;
+} free_job_t;
+
+
+static void* free_blocks(void *arg) {
+    free_job_t *job = arg;
+    atomic_store(&job->started, true);
+    for (size_t i = 0; i < job->count; i++) {
+        if (job->arena) heap_arena_free(job->arena, job->blocks[i]);
+        else heap_free(job->blocks[i]);
+    }
+    return NULL;
+}
+
+
+/* Frees the job's blocks from another thread while the lock is held, long enough for a full queue to wait for it */
+static void free_contended(pthread_mutex_t *mutex, free_job_t *job) {
+    pthread_t thread;
+    struct timespec pause = {0, 20000000};
+    pthread_mutex_lock(mutex);
+    atomic_store(&job->started, false);
+    assert(pthread_create(&thread, NULL, free_blocks, job) == 0);
+    while (!atomic_load(&job->started)) nanosleep(&pause, NULL);
+    nanosleep(&pause, NULL);
+    pthread_mutex_unlock(mutex);
+    pthread_join(thread, NULL);
+}
+
+
+static uint8_t* filled_block(heap_arena_t *arena) {
+    uint8_t *block = arena ? heap_arena_malloc(arena, BLOCK_SIZE) : heap_malloc(BLOCK_SIZE);
+    assert(block);
+    memset(block, 0xAB, BLOCK_SIZE);
+    return block;
+}
+
+
+static void free_drain(heap_arena_t *arena) {
+    void *drain = filled_block(arena);
+    if (arena) heap_arena_free(arena, drain);       //Past the thread cache sizes, freed under the lock
+    else heap_free(drain);
+}
+
+
+static bool is_filled(const uint8_t *block) {
+    for (size_t i = 0; i < BLOCK_SIZE; i++) {
+        if (block[i] != 0xAB) return false;
+    }
+    return true;
+}
+
+
+static void bad_pointers(heap_arena_t *arena, pthread_mutex_t *mutex) {
+    uint8_t *block = filled_block(arena);
+    uint8_t *freed = filled_block(arena);
+    if (arena) heap_arena_free(arena, freed);
+    else heap_free(freed);
+
+    free_job_t job = {arena, {block + 64, block + 1, freed, block + BLOCK_SIZE}, 4, false};
+    free_contended(mutex, &job);
+    free_drain(arena);
+    assert(is_filled(block));
+    assert((arena ? heap_arena_get_pointer_type(arena, block) : get_pointer_type(block)) == pointer_valid);
+    assert((arena ? heap_arena_validate(arena) : heap_validate()) == 0);
+}
+
+
+static void queued_blocks(heap_arena_t *arena, pthread_mutex_t *mutex) {
+    Heap__ *heap = arena ? arena : main_heap;
+    uint8_t *blocks[3] = {filled_block(arena), filled_block(arena), filled_block(arena)};
+    uint8_t *drain = filled_block(arena);
+    free_job_t job = {arena, {blocks[0], blocks[1], blocks[2]}, 3, false};
+    free_contended(mutex, &job);
+    assert(atomic_load(&heap->remote_pending) == 3);
+
+    //The middle block is freed again before the queue is drained, the others still are
+    pthread_mutex_lock(mutex);
+    free_block(heap, blocks[1]);
+    free_unlocked(heap, drain);
+    pthread_mutex_unlock(mutex);
+    assert(!atomic_load(&heap->remote_pending));
+    for (size_t i = 0; i < 3; i++) {
+        assert((arena ? heap_arena_get_pointer_type(arena, blocks[i]) : get_pointer_type(blocks[i])) != pointer_valid);
+    }
+
+    //Queued twice, freed once
+    blocks[0] = filled_block(arena);
+    blocks[1] = filled_block(arena);
+    free_job_t twice = {arena, {blocks[0], blocks[1], blocks[0]}, 3, false};
+    free_contended(mutex, &twice);
+    free_drain(arena);
+    assert(!atomic_load(&heap->remote_pending));
+    assert((arena ? heap_arena_validate(arena) : heap_validate()) == 0);
+}
+
+
+/* Frees past the queue's slots wait for the lock, the queued ones are freed by the next drain */
+static void full_queue(heap_arena_t *arena, pthread_mutex_t *mutex) {
+    free_job_t job = {arena, {NULL}, REMOTE_FREE_SLOTS + 4, false};
+    for (size_t i = 0; i < job.count; i++) job.blocks[i] = filled_block(arena);
+    free_contended(mutex, &job);
+    free_drain(arena);
+    for (size_t i = 0; i < job.count; i++) {
+        assert((arena ? heap_arena_get_pointer_type(arena, job.blocks[i]) : get_pointer_type(job.blocks[i])) != pointer_valid);
+    }
+    assert((arena ? heap_arena_validate(arena) : heap_validate()) == 0);
+}
+
+
+int main(void) {
+    assert(heap_setup() == 0);
+    heap_set_check_mode(heap_check_off, 1);
+    heap_arena_t *arena = heap_arena_create(0x100000);
+    assert(arena);
+
+    bad_pointers(NULL, &heap_mutex);
+    bad_pointers(arena, &arena->mutex);
+    queued_blocks(NULL, &heap_mutex);
+    queued_blocks(arena, &arena->mutex);
+    full_queue(NULL, &heap_mutex);
+    full_queue(arena, &arena->mutex);
+
+    heap_arena_destroy(arena);
+    heap_clean();
+    printf("remote frees ok\n");
+    return 0;
+}
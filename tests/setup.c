@@ -0,0 +1,50 @@
+/*
+ * heap_setup() called again without heap_clean() in between, built and run by `make test`.
+ * heap.c is included like in the other tests, the page map of the default heap is checked directly.
+ */
+#include <assert.h>
+#include "../heap.c"
+
+#define BLOCKS 64
+#define BLOCK_SIZE 3000
+
+
+static void allocate(uint8_t **blocks) {
+    for (size_t i = 0; i < BLOCKS; i++) {
+        blocks[i] = heap_malloc(BLOCK_SIZE);
+        assert(blocks[i]);
+        memset(blocks[i], (int)i, BLOCK_SIZE);
+    }
+    for (size_t i = 0; i < BLOCKS; i++) {
+        assert(get_pointer_type(blocks[i]) == pointer_valid);
+        assert(get_pointer_type(blocks[i] + 1) == pointer_inside_data_block);
+    }
+}
+
+
+int main(void) {
+    uint8_t *blocks[BLOCKS];
+    assert(heap_setup() == 0);
+    uint64_t reserved = custom_sbrk_get_reserved_memory();
+    allocate(blocks);
+    for (size_t i = 0; i < BLOCKS; i += 2) heap_free(blocks[i]);
+    heap_handle_t handle = heap_handle_alloc(BLOCK_SIZE);
+    assert(heap_handle_pin(handle));
+
+    //The first heap is released, the second one starts with a page map describing only itself
+    assert(heap_setup() == 0);
+    assert(custom_sbrk_get_reserved_memory() == reserved);
+    assert(!heap_handle_pin(handle));
+    for (size_t page = 0; page < HEAP_MAX_PAGES; page++) {
+        PageEntry__ *entry = main_page_map + page;
+        assert(page < main_heap->pages || (!entry->first && !entry->cover && !entry->slab));
+    }
+    allocate(blocks);
+    assert(heap_validate() == 0);
+    for (size_t i = 0; i < BLOCKS; i++) heap_free(blocks[i]);
+    assert(heap_validate() == 0);
+
+    heap_clean();
+    printf("setup ok\n");
+    return 0;
+}
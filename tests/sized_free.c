@@ -0,0 +1,39 @@
+/*
+ * heap_free_sized() of blocks that are already free or were never allocated, built and run by `make test`.
+ * Neither the thread cache nor the heap may hand a block out twice afterwards.
+ */
+#include <assert.h>
+#include "../heap.c"
+
+#define SIZES 5
+
+
+int main(void) {
+    const size_t sizes[SIZES] = {600, 2000, 16, 24, 200};
+    assert(heap_setup() == 0);
+    heap_set_check_mode(heap_check_off, 0);     //The size is trusted and the thread cache on outside heap_check_full
+    for (size_t i = 0; i < SIZES; i++) {
+        void *block = heap_malloc(sizes[i]);
+        assert(block);
+        heap_free_sized(block, sizes[i]);
+        heap_free_sized(block, sizes[i]);
+
+        void *first = heap_malloc(sizes[i]), *second = heap_malloc(sizes[i]);
+        assert(first && second && first != second);
+        heap_free_sized(first, sizes[i]);
+        heap_free_sized(second, sizes[i]);
+    }
+
+    //Pointers inside a block and sizes the block can't have leave it allocated
+    uint8_t *block = heap_malloc(sizes[0]);
+    heap_free_sized(block + 64, sizes[0] - 64);
+    heap_free_sized(block, sizes[0] * 4);
+    assert(get_pointer_type(block) == pointer_valid);
+    heap_free_sized(block, sizes[0]);
+    assert(get_pointer_type(block) != pointer_valid);
+    assert(heap_validate() == 0);
+
+    heap_clean();
+    printf("sized frees ok\n");
+    return 0;
+}
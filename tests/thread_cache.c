@@ -0,0 +1,41 @@
+/*
+ * Blocks parked in the thread cache by heap_free(), built and run by `make test`.
+ * They stay taken in their slab, but have to be reported as freed until heap_malloc() hands them out again.
+ */
+#include <assert.h>
+#include "../heap.c"
+
+#define BLOCK_SIZE 200
+#define OTHER_SIZE 100
+
+
+int main(void) {
+    assert(heap_setup() == 0);
+    heap_set_check_mode(heap_check_off, 0);     //The thread cache is off in heap_check_full
+    uint8_t *other = heap_malloc(OTHER_SIZE);
+    uint8_t *block = heap_malloc(BLOCK_SIZE);
+    assert(other && block && slab_of(main_heap, block));
+    assert(heap_get_largest_used_block_size() >= BLOCK_SIZE);
+
+    heap_free(block);
+    assert(get_pointer_type(block) == pointer_unallocated);
+    assert(get_pointer_type(block + 1) == pointer_unallocated);
+    assert(heap_get_largest_used_block_size() < BLOCK_SIZE);
+    assert(heap_realloc(block, BLOCK_SIZE * 2) == NULL);
+
+    //Freed again, the block is neither cached nor freed twice
+    heap_free(block);
+    heap_free_sized(block, BLOCK_SIZE);
+    uint8_t *first = heap_malloc(BLOCK_SIZE), *second = heap_malloc(BLOCK_SIZE);
+    assert(first == block && second != block);
+    assert(get_pointer_type(first) == pointer_valid);
+    assert(heap_get_largest_used_block_size() >= BLOCK_SIZE);
+
+    heap_free(first);
+    heap_free(second);
+    heap_free(other);
+    assert(heap_validate() == 0);
+    heap_clean();
+    printf("thread cache ok\n");
+    return 0;
+}